@@ -0,0 +1,432 @@
+#ifndef __CENTIPEDE__ACCESS_LOG__H__
+#define __CENTIPEDE__ACCESS_LOG__H__
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "ib/logger.h"
+#include "centipede/types.h"
+
+#define ACCESS_LOG_RINGS 64
+#define ACCESS_LOG_RING_RECORDS 4096
+#define ACCESS_LOG_FLUSH_MS 100
+#define ACCESS_LOG_TEXT_BYTES 196
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+enum AccessKind {
+	ACCESS_REQUEST,
+	ACCESS_EVENT,
+};
+
+/* AccessRecord is one line of the access log as it waits in a ring, fixed
+ * in size so that writing it copies and never allocates. The address is
+ * kept raw and only formatted by the flusher. text is the url of a request
+ * or the name of an event, cut to fit and nul terminated. */
+struct AccessRecord {
+	uint64_t time_us;
+	uint64_t duration_us;
+	uint64_t cid;
+	uint64_t bytes;
+	uint16_t status;
+	uint8_t kind;
+	uint8_t family;
+	char method[8];
+	uint8_t address[16];
+	char text[ACCESS_LOG_TEXT_BYTES];
+};
+
+static_assert(sizeof(AccessRecord) == 256, "AccessRecord size");
+
+/* AccessLog is a structured log of requests and server events, written as
+ * JSON lines to a file by a background thread. Each thread writing to it
+ * takes a ring of its own, a single-producer single-consumer queue of
+ * AccessRecords, so that logging is a copy into memory mapped when the log
+ * opened, without locks or allocation. A record that finds its ring full,
+ * or no ring free, is dropped and counted rather than waited for. Every
+ * flush_ms the flusher drains all rings into one write.
+ *
+ * Requests may be sampled, one logged in every sample; events are always
+ * logged. The log is off until open() is called.
+ */
+class AccessLog {
+public:
+	AccessLog() : _fd(-1), _sample(1), _flush_ms(ACCESS_LOG_FLUSH_MS),
+		_running(false), _dropped(0) {}
+
+	~AccessLog() {
+		close();
+	}
+
+	bool enabled() const {
+		return _fd >= 0;
+	}
+
+	/* open: starts logging to the end of path. Must not be called while
+	 * the server is running. */
+	bool open(const string& path, int sample, int flush_ms) {
+		close();
+		_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND |
+			     O_CLOEXEC, 0644);
+		if (_fd < 0) {
+			Logger::error("(access_log) cannot open %", path);
+			return false;
+		}
+		_rings.reset(new Rings());
+		if (!_rings->records) {
+			Logger::error("(access_log) cannot map % rings",
+				      ACCESS_LOG_RINGS);
+			_rings.reset();
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		_sample = max(sample, 1);
+		_flush_ms = flush_ms > 0 ? flush_ms : ACCESS_LOG_FLUSH_MS;
+		_running = true;
+		_flusher.reset(new thread(&AccessLog::flusher, this));
+		return true;
+	}
+
+	/* close: writes out what is left and stops logging. */
+	void close() {
+		if (_fd < 0) return;
+		_running = false;
+		_flusher->join();
+		_flusher.reset();
+		flush();
+		::close(_fd);
+		_fd = -1;
+	}
+
+	/* begin: marks the start of a request on the calling thread, which
+	 * is taken to succeed with an empty reply until reply() and sent()
+	 * say otherwise. */
+	static void begin() {
+		Pending& pending = AccessLog::pending();
+		pending.status = 200;
+		pending.bytes = 0;
+	}
+
+	/* reply: the status of the request the calling thread is serving. */
+	static void reply(unsigned int status) {
+		pending().status = status;
+	}
+
+	/* sent: the bytes sent for the request the calling thread is
+	 * serving. */
+	static void sent(size_t bytes) {
+		pending().bytes += bytes;
+	}
+
+	/* request: logs the request the calling thread has just served,
+	 * begun at start on the Metrics::now() clock, if it is sampled. */
+	void request(const struct sockaddr* addr, const char* method,
+		     const char* url, uint64_t start, uint64_t now) {
+		if (_fd < 0) return;
+		Writer& writer = this->writer();
+		if (_sample > 1 && ++writer.requests % _sample) return;
+		AccessRecord* record = writer.reserve(this);
+		if (!record) return;
+		const Pending& pending = AccessLog::pending();
+		record->kind = ACCESS_REQUEST;
+		record->duration_us = now - start;
+		record->cid = 0;
+		record->bytes = pending.bytes;
+		record->status = pending.status;
+		copy(record->method, method, sizeof(record->method));
+		copy(record->text, url, sizeof(record->text));
+		set_address(record, addr);
+		writer.commit();
+	}
+
+	/* event: logs a server event about cid, with a number. */
+	void event(const char* name, const ClientID& cid, uint64_t value,
+		   const struct sockaddr* addr = nullptr) {
+		if (_fd < 0) return;
+		Writer& writer = this->writer();
+		AccessRecord* record = writer.reserve(this);
+		if (!record) return;
+		record->kind = ACCESS_EVENT;
+		record->duration_us = 0;
+		record->cid = cid;
+		record->bytes = value;
+		record->status = 0;
+		record->method[0] = 0;
+		copy(record->text, name, sizeof(record->text));
+		set_address(record, addr);
+		writer.commit();
+	}
+
+protected:
+	/* Ring is the queue of one writing thread. head is only moved by the
+	 * writer and tail only by the flusher. */
+	struct Ring {
+		alignas(64) atomic<uint64_t> head;
+		alignas(64) atomic<uint64_t> tail;
+		atomic<bool> taken;
+	};
+
+	/* Rings is the memory of all the rings, shared with the threads
+	 * holding one, so that a thread outliving the log still releases
+	 * its ring safely. */
+	struct Rings {
+		Rings() : rings(new Ring[ACCESS_LOG_RINGS]) {
+			for (int i = 0; i < ACCESS_LOG_RINGS; ++i) {
+				rings[i].head = 0;
+				rings[i].tail = 0;
+				rings[i].taken = false;
+			}
+			bytes = sizeof(AccessRecord) * ACCESS_LOG_RINGS *
+				ACCESS_LOG_RING_RECORDS;
+			/* pages are only committed as the rings fill */
+			void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			records = data == MAP_FAILED ?
+				nullptr : (AccessRecord*) data;
+		}
+
+		~Rings() {
+			if (records) munmap(records, bytes);
+		}
+
+		AccessRecord* slot(int ring, uint64_t index) {
+			return &records[ring * ACCESS_LOG_RING_RECORDS +
+					index % ACCESS_LOG_RING_RECORDS];
+		}
+
+		unique_ptr<Ring[]> rings;
+		AccessRecord* records;
+		size_t bytes;
+	};
+
+	/* Writer is a thread's hold on a ring of one log, given back when
+	 * the thread exits. */
+	struct Writer {
+		Writer() : owner(nullptr), ring(-1), requests(0) {}
+
+		~Writer() {
+			release();
+		}
+
+		void release() {
+			if (ring >= 0) {
+				rings->rings[ring].taken.store(
+					false, memory_order_release);
+			}
+			rings.reset();
+			ring = -1;
+		}
+
+		/* reserve: the next free record of the ring, taking a ring
+		 * first if need be, or nullptr to drop the record. */
+		AccessRecord* reserve(AccessLog* log) {
+			if (owner != log || rings != log->_rings) {
+				release();
+				owner = log;
+				rings = log->_rings;
+			}
+			if (ring < 0) ring = take(rings.get());
+			if (ring < 0) {
+				log->_dropped.fetch_add(1, memory_order_relaxed);
+				return nullptr;
+			}
+			Ring& r = rings->rings[ring];
+			uint64_t head = r.head.load(memory_order_relaxed);
+			if (head - r.tail.load(memory_order_acquire) >=
+			    ACCESS_LOG_RING_RECORDS) {
+				log->_dropped.fetch_add(1, memory_order_relaxed);
+				return nullptr;
+			}
+			AccessRecord* record = rings->slot(ring, head);
+			record->time_us = wall_us();
+			return record;
+		}
+
+		void commit() {
+			Ring& r = rings->rings[ring];
+			r.head.store(r.head.load(memory_order_relaxed) + 1,
+				     memory_order_release);
+		}
+
+		static int take(Rings* rings) {
+			for (int i = 0; i < ACCESS_LOG_RINGS; ++i) {
+				bool expected = false;
+				if (rings->rings[i].taken.load(memory_order_relaxed))
+					continue;
+				if (rings->rings[i].taken.compare_exchange_strong(
+					    expected, true,
+					    memory_order_acquire)) {
+					return i;
+				}
+			}
+			return -1;
+		}
+
+		AccessLog* owner;
+		shared_ptr<Rings> rings;
+		int ring;
+		uint64_t requests;
+	};
+
+	/* Pending is what is known of the request the thread is serving. */
+	struct Pending {
+		unsigned int status;
+		uint64_t bytes;
+	};
+
+	static Pending& pending() {
+		thread_local Pending pending = {200, 0};
+		return pending;
+	}
+
+	static Writer& writer() {
+		thread_local Writer writer;
+		return writer;
+	}
+
+	static uint64_t wall_us() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+
+	static void copy(char* to, const char* from, size_t size) {
+		size_t length = from ? strnlen(from, size - 1) : 0;
+		memcpy(to, from, length);
+		to[length] = 0;
+	}
+
+	static void set_address(AccessRecord* record,
+				const struct sockaddr* addr) {
+		record->family = addr ? addr->sa_family : 0;
+		if (record->family == AF_INET) {
+			memcpy(record->address,
+			       &((const struct sockaddr_in*) addr)->sin_addr, 4);
+		} else if (record->family == AF_INET6) {
+			memcpy(record->address,
+			       &((const struct sockaddr_in6*) addr)->sin6_addr,
+			       16);
+		} else {
+			record->family = 0;
+		}
+	}
+
+	void flusher() {
+		while (_running) {
+			this_thread::sleep_for(chrono::milliseconds(_flush_ms));
+			flush();
+		}
+	}
+
+	/* flush: drains every ring into one write. */
+	void flush() {
+		_buffer.clear();
+		for (int i = 0; i < ACCESS_LOG_RINGS; ++i) {
+			Ring& r = _rings->rings[i];
+			uint64_t tail = r.tail.load(memory_order_relaxed);
+			uint64_t head = r.head.load(memory_order_acquire);
+			for (; tail < head; ++tail) {
+				format(*_rings->slot(i, tail), &_buffer);
+			}
+			r.tail.store(tail, memory_order_release);
+		}
+		uint64_t dropped = _dropped.exchange(0, memory_order_relaxed);
+		if (dropped) {
+			_buffer += "{\"time_us\":" + to_string(wall_us()) +
+				",\"event\":\"dropped\",\"value\":" +
+				to_string(dropped) + "}\n";
+		}
+		size_t done = 0;
+		while (done < _buffer.length()) {
+			ssize_t w = write(_fd, _buffer.data() + done,
+					  _buffer.length() - done);
+			if (w <= 0) break;
+			done += w;
+		}
+	}
+
+	static void format(const AccessRecord& record, string* output) {
+		*output += "{\"time_us\":";
+		*output += to_string(record.time_us);
+		if (record.family) {
+			char buf[INET6_ADDRSTRLEN];
+			if (inet_ntop(record.family, record.address, buf,
+				      sizeof(buf))) {
+				*output += ",\"address\":\"";
+				*output += buf;
+				*output += '"';
+			}
+		}
+		if (record.kind == ACCESS_EVENT) {
+			*output += ",\"event\":";
+			quote(record.text, output);
+			*output += ",\"cid\":";
+			*output += to_string(record.cid);
+			*output += ",\"value\":";
+			*output += to_string(record.bytes);
+			*output += "}\n";
+			return;
+		}
+		*output += ",\"method\":";
+		quote(record.method, output);
+		*output += ",\"url\":";
+		quote(record.text, output);
+		*output += ",\"status\":";
+		*output += to_string(record.status);
+		*output += ",\"bytes\":";
+		*output += to_string(record.bytes);
+		*output += ",\"duration_us\":";
+		*output += to_string(record.duration_us);
+		*output += "}\n";
+	}
+
+	/* quote: appends text as a JSON string. */
+	static void quote(const char* text, string* output) {
+		static const char hex[] = "0123456789abcdef";
+		*output += '"';
+		for (const char* p = text; *p; ++p) {
+			unsigned char c = *p;
+			if (c == '"' || c == '\\') {
+				*output += '\\';
+				*output += c;
+			} else if (c < 0x20) {
+				*output += "\\u00";
+				*output += hex[c >> 4];
+				*output += hex[c & 15];
+			} else {
+				*output += c;
+			}
+		}
+		*output += '"';
+	}
+
+	int _fd;
+	int _sample;
+	int _flush_ms;
+	atomic<bool> _running;
+	atomic<uint64_t> _dropped;
+	shared_ptr<Rings> _rings;
+	unique_ptr<thread> _flusher;
+	string _buffer;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__ACCESS_LOG__H__
@@ -0,0 +1,77 @@
+#ifndef __CENTIPEDE__ASYNC_REPLY__H__
+#define __CENTIPEDE__ASYNC_REPLY__H__
+
+#include <condition_variable>
+#include <microhttpd.h>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+namespace centipede {
+
+/* AsyncReply carries the output of a request whose backend call completes
+ * on another thread. The handler calls ready_or_suspend() once the call
+ * has been started: if the output is already there the handler sends it
+ * straight away, otherwise the connection is suspended and its thread
+ * goes back to serving others until complete() resumes it. In
+ * thread-per-connection mode, where microhttpd cannot suspend, the
+ * handler blocks instead.
+ */
+class AsyncReply {
+public:
+	AsyncReply(struct MHD_Connection* connection, bool can_suspend)
+		: _connection(connection), _can_suspend(can_suspend),
+		  _ready(false), _suspended(false) {}
+
+	/* output: written by the completing side before complete(), read by
+	 * the handler once ready. */
+	string* output() {
+		return &_output;
+	}
+
+	/* complete: marks the output ready and wakes the request. Must be
+	 * called exactly once. */
+	void complete() {
+		unique_lock<mutex> ul(_mutex);
+		_ready = true;
+		if (_suspended) {
+			_suspended = false;
+			MHD_resume_connection(_connection);
+		}
+		_cv.notify_all();
+	}
+
+	/* ready_or_suspend: returns true if the output is ready to send.
+	 * Otherwise the connection is suspended and the handler should return
+	 * MHD_YES; it is called again after complete(). */
+	bool ready_or_suspend() {
+		unique_lock<mutex> ul(_mutex);
+		if (_ready) return true;
+		if (!_can_suspend) {
+			_cv.wait(ul, [this]() { return _ready; });
+			return true;
+		}
+		MHD_suspend_connection(_connection);
+		_suspended = true;
+		return false;
+	}
+
+	bool ready() {
+		unique_lock<mutex> ul(_mutex);
+		return _ready;
+	}
+
+protected:
+	struct MHD_Connection* _connection;
+	bool _can_suspend;
+	mutex _mutex;
+	condition_variable _cv;
+	bool _ready;
+	bool _suspended;
+	string _output;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__ASYNC_REPLY__H__
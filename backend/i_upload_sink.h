@@ -0,0 +1,43 @@
+#ifndef __CENTIPEDE__I_UPLOAD_SINK__H__
+#define __CENTIPEDE__I_UPLOAD_SINK__H__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace centipede {
+
+/* IUploadSink receives one POST upload. The webserver opens it once when
+ * the request arrives, feeds it every chunk the post processor decodes,
+ * and then either finishes or aborts it, never both. The views passed to
+ * write are only valid for the duration of the call. No webserver lock is
+ * held while the sink runs.
+ */
+class IUploadSink {
+public:
+	virtual ~IUploadSink() {}
+
+	/* write: receives size bytes of field key, starting at offset within
+	 * that field. Returning false stops the upload. */
+	virtual bool write(string_view key, string_view filename,
+			   string_view content_type, string_view encoding,
+			   string_view data, uint64_t offset) = 0;
+
+	/* finish: the upload is complete. */
+	virtual void finish() = 0;
+
+	/* abort: the connection closed before the upload completed. */
+	virtual void abort() {}
+
+	/* failed: after finish, whether the upload was lost on the way to
+	 * the backend, in which case its command is not run. */
+	virtual bool failed() const {
+		return false;
+	}
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__I_UPLOAD_SINK__H__
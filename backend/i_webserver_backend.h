@@ -1,22 +1,65 @@
 #ifndef __CENTIPEDE__I_WEBSERVER_BACKEND__H__
 #define __CENTIPEDE__I_WEBSERVER_BACKEND__H__
 
+#include <functional>
 #include <map>
+#include <memory_resource>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "centipede/backend/i_upload_sink.h"
+#include "centipede/backend/resource_body.h"
+#include "centipede/nodes/i_node.h"
+#include "centipede/output_sink.h"
 #include "centipede/types.h"
 
 using namespace std;
 
 namespace centipede {
 
+/* ParameterViews and ArgumentViews are the parameters and query arguments
+ * of a request as views into the request, in containers allocated from its
+ * RequestArena. Like the strings they stand for, they are only valid
+ * during the call, or until done for the _async methods. */
+typedef pmr::vector<string_view> ParameterViews;
+typedef pmr::map<string_view, string_view> ArgumentViews;
+
+inline vector<string> to_strings(const ParameterViews& views) {
+	return vector<string>(views.begin(), views.end());
+}
+
+inline map<string, string> to_strings(const ArgumentViews& views) {
+	map<string, string> output;
+	for (auto& x : views) output.emplace(x.first, x.second);
+	return output;
+}
+
+/* IClientPush is implemented by the webserver for backends to send a
+ * message to the WebSockets of a client, or of all clients with
+ * CLIENT_ALL. It may be called from any thread. */
+class IClientPush {
+public:
+	virtual ~IClientPush() {}
+	virtual void push(const ClientID&, const string& message) = 0;
+};
+
 /* AbstractWebserverBackend is a virtual class that is used by the WebServer.
  * Each program using a built-in webserver is required to create its own
  * implementaiton of this virtual class and provide an instance to the
  * webserver. This abstraction provides the interface for the webserver
  * to operate without specific knowledge of the application.
+ *
+ * Concurrency: the webserver holds no lock of its own while calling into
+ * the backend, and methods may run concurrently on server threads. For one
+ * client, the calls that change its session, set_value, run_command and
+ * run_node_command, run one at a time: each sees the state the previous
+ * one returned, and an _async one counts as running until its done is
+ * called. The others wait in the order they came, without holding a
+ * server thread unless in thread-per-connection mode. Reads, get_page, get_value and the resource methods, are not
+ * ordered with them and may run alongside for the same client, so state
+ * they share with a command must be guarded by the backend.
  */
 class IWebserverBackend {
 public:
@@ -24,9 +67,42 @@ public:
 
 	/* get_page: takes the client ID and current state and places the
 		     html output in the string parameter. */
-	virtual void get_page(const ClientID&, int state,
+	virtual void get_page(const ClientID& cid, int state,
 			      string* output) = 0;
 
+	/* get_page: takes the client ID and current state and appends the
+		     html output to the sink. This is the overload the
+		     webserver calls. By default it adapts the string
+		     overload; a backend rendering into the sink directly
+		     overrides this one too. */
+	virtual void get_page(const ClientID& cid, int state,
+			      OutputSink* output) {
+		string page;
+		get_page(cid, state, &page);
+		output->append(page);
+	}
+
+	/* page_version: returns a number that changes whenever the page for
+	 * 		 this client and state would render differently. While
+	 * 		 it is unchanged the webserver may serve its cached
+	 * 		 render instead of calling get_page. Zero, the default,
+	 * 		 means the page is never cached. */
+	virtual uint64_t page_version(const ClientID&, int state) {
+		return 0;
+	}
+
+	/* get_fragments: after a command, appends the fragment nodes of the
+	 * 		  client's page changed after the version since, and
+	 * 		  sets version to BaseNode::now() as read before
+	 * 		  collecting them; usually the root node's fragments().
+	 * 		  Returning false, the default, makes the webserver
+	 * 		  send the whole page. */
+	virtual bool get_fragments(const ClientID&, int state, uint64_t since,
+				   uint64_t* version,
+				   vector<Fragment>* output) {
+		return false;
+	}
+
 	/* get_resource: takes the client ID and resource ID and places the
 			 raw resource in the string parameter. It throws an
 			 exception if the client is not authorized for the
@@ -36,6 +112,16 @@ public:
 				  const string& ject,
 				  string* output) = 0;
 
+	/* open_resource: hands over the resource as a ResourceBody to be
+	 * 		  streamed, for resources too large to hold in a
+	 * 		  string; Range requests are answered from it. It
+	 * 		  throws as get_resource does. Returning false, the
+	 * 		  default, makes the webserver call get_resource. */
+	virtual bool open_resource(const ClientID&, const ResourceID&,
+				   const string& ject, ResourceBody* body) {
+		return false;
+	}
+
 	virtual bool get_value(const ClientID&, int state,
                                const string& name,
                                const vector<string>& parameters,
@@ -56,6 +142,79 @@ public:
 				const vector<string>& parameters,
 				const map<string, string>& arguments) = 0;
 
+	/* The overloads below, taking ParameterViews and ArgumentViews, are
+	 * the ones the webserver calls. By default they copy the views for
+	 * the string overloads; a backend overriding them serves requests
+	 * without allocating for the parameters. get_value appends the
+	 * value to output. */
+	virtual bool get_value(const ClientID& cid, int state,
+			       string_view name,
+			       const ParameterViews& parameters,
+			       const ArgumentViews& arguments,
+			       OutputSink* output) {
+		string value;
+		bool ok = get_value(cid, state, string(name),
+				    to_strings(parameters),
+				    to_strings(arguments), &value);
+		output->append(value);
+		return ok;
+	}
+
+	virtual bool set_value(const ClientID& cid, int state,
+			       string_view name,
+			       const ParameterViews& parameters,
+			       const ArgumentViews& arguments) {
+		return set_value(cid, state, string(name),
+				 to_strings(parameters),
+				 to_strings(arguments));
+	}
+
+	virtual int run_command(const ClientID& cid, int state,
+				string_view command,
+				const ParameterViews& parameters,
+				const ArgumentViews& arguments) {
+		return run_command(cid, state, string(command),
+				   to_strings(parameters),
+				   to_strings(arguments));
+	}
+
+	/* The _async variants below let a backend complete get_value,
+	 * get_resource and run_command on a thread of its own. The webserver
+	 * suspends the connection meanwhile, so a slow call does not hold a
+	 * server thread. The parameters and arguments stay valid until done
+	 * is called, but no longer. done must be called exactly once, from
+	 * any thread. The defaults call the synchronous view overloads above
+	 * and complete inline, so a backend overriding only those is still
+	 * the one that serves these requests. */
+	virtual void get_value_async(const ClientID& cid, int state,
+				     string_view name,
+				     const ParameterViews& parameters,
+				     const ArgumentViews& arguments,
+				     function<void(const string&)> done) {
+		string output;
+		OutputSink sink(&output);
+		get_value(cid, state, name, parameters, arguments, &sink);
+		done(output);
+	}
+
+	virtual void get_resource_async(const ClientID& cid,
+					const ResourceID& rid,
+					const string& ject,
+					function<void(const string&)> done) {
+		string output;
+		get_resource(cid, rid, ject, &output);
+		done(output);
+	}
+
+	/* run_command_async: done receives the new state. */
+	virtual void run_command_async(const ClientID& cid, int state,
+				       string_view command,
+				       const ParameterViews& parameters,
+				       const ArgumentViews& arguments,
+				       function<void(int)> done) {
+		done(run_command(cid, state, command, parameters, arguments));
+	}
+
 	/* run_node_command: takes the client ID, current state, the name of the
 	 * 		     the node, and a vector of arguments to send it. It
 	 *		     sends the arguments to the named node.
@@ -66,6 +225,15 @@ public:
 				      const vector<string>& parameters,
 				      const map<string, string>& arguments) = 0;
 
+	/* open_upload: returns a sink, owned by the caller, for a POST to
+	 * 		the command. The default passes each chunk on to
+	 * 		recv_post. */
+	virtual IUploadSink* open_upload(const ClientID& cid, int state,
+					 const string& command);
+
+	/* recv_post: receives one chunk of a POST to the command. The end of
+	 * 	      the upload is marked by an empty chunk with a null
+	 * 	      output. */
 	virtual int recv_post(const ClientID&, const string& command,
 			      const string& key, const string& filename,
 			      const string& content_type, const string& encoding,
@@ -79,8 +247,62 @@ public:
 
 	/* bye_client: informs the backend that a client has ended a session. */
 	virtual void bye_client(const ClientID&) = 0;
+
+	/* restore_client: informs the backend, in place of new_client, of a
+	 * 		   session brought back from the session snapshot at
+	 * 		   startup, with the blob last saved for it. */
+	virtual void restore_client(const ClientID& cid, int state,
+				    const string& blob) {
+		new_client(cid);
+	}
+
+	/* session_blob: returns what the backend needs saved with the
+	 * 		 session to restore it, at most
+	 * 		 SESSION_SNAPSHOT_BLOB_BYTES. It is asked after the
+	 * 		 session is created and after every set or command. */
+	virtual string session_blob(const ClientID&, int state) {
+		return "";
+	}
+
+	/* set_push: gives the backend the webserver's push channel. */
+	virtual void set_push(IClientPush*) {}
 };
 
+/* RecvPostUploadSink adapts an upload to the chunked recv_post calls. */
+class RecvPostUploadSink : public IUploadSink {
+public:
+	RecvPostUploadSink(IWebserverBackend* backend, const ClientID& cid,
+			   const string& command)
+		: _backend(backend), _cid(cid), _command(command) {}
+
+	virtual bool write(string_view key, string_view filename,
+			   string_view content_type, string_view encoding,
+			   string_view data, uint64_t offset) {
+		_backend->recv_post(_cid, _command, string(key),
+				    string(filename), string(content_type),
+				    string(encoding), string(data), offset,
+				    data.length(), &_answer);
+		return true;
+	}
+
+	virtual void finish() {
+		_backend->recv_post(_cid, _command, "", "", "", "", "", 0, 0,
+				    nullptr);
+	}
+
+protected:
+	IWebserverBackend* _backend;
+	ClientID _cid;
+	string _command;
+	string _answer;
+};
+
+inline IUploadSink* IWebserverBackend::open_upload(const ClientID& cid,
+						   int state,
+						   const string& command) {
+	return new RecvPostUploadSink(this, cid, command);
+}
+
 }  // namespace centipede
 
 #endif  // __CENTIPEDE__I_WEBSERVER_BACKEND__H__
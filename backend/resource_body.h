@@ -0,0 +1,66 @@
+#ifndef __CENTIPEDE__RESOURCE_BODY__H__
+#define __CENTIPEDE__RESOURCE_BODY__H__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define RESOURCE_SIZE_UNKNOWN ((uint64_t) -1LL)
+
+using namespace std;
+
+namespace centipede {
+
+/* ResourceBody is a resource a backend hands over to be streamed rather
+ * than rendered into a string: either an open file descriptor, sent from
+ * offset for size bytes with sendfile where available, or a generator
+ * pulled for one block at a time as the connection drains.
+ *
+ * generate(position, buffer, max) writes up to max bytes of the resource
+ * from position into buffer and returns how many, 0 at the end, or -1 on
+ * an error, which aborts the reply. It runs on a server thread and must
+ * not block for long. If size is known, a Range request may start it at
+ * any position; a generator that can only run from the start sets
+ * ranges to false.
+ *
+ * etag, a strong entity tag with its quotes, and last_modified, an HTTP
+ * date, are the resource's validators. They are sent with the reply, and
+ * a Range request with an If-Range is only answered with a part if its
+ * validator is the same; otherwise the whole resource is sent. Without
+ * either, such a request always gets the whole resource.
+ *
+ * The webserver takes ownership of fd, closing it when the reply is done.
+ */
+struct ResourceBody {
+	ResourceBody() : fd(-1), offset(0), size(RESOURCE_SIZE_UNKNOWN),
+		ranges(true) {}
+
+	~ResourceBody() {
+		if (fd >= 0) close(fd);
+	}
+
+	ResourceBody(const ResourceBody&) = delete;
+	ResourceBody& operator=(const ResourceBody&) = delete;
+
+	/* release: gives up ownership of fd. */
+	int release() {
+		int x = fd;
+		fd = -1;
+		return x;
+	}
+
+	int fd;
+	uint64_t offset;
+	uint64_t size;
+	function<ssize_t(uint64_t, char*, size_t)> generate;
+	bool ranges;
+	string content_type;
+	string etag;
+	string last_modified;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__RESOURCE_BODY__H__
@@ -0,0 +1,41 @@
+#ifndef __CENTIPEDE__BENCH__BENCH__H__
+#define __CENTIPEDE__BENCH__BENCH__H__
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+namespace centipede {
+
+/* Bench times a function over a number of iterations, after a warm up of
+ * a tenth as many, and prints the mean time per iteration. The function
+ * returns a size_t, such as a length, which is kept in a volatile sink so
+ * that the work cannot be optimised away. */
+class Bench {
+public:
+	template<typename F>
+	static double run(const string& name, uint64_t iterations, F f) {
+		for (uint64_t i = 0; i < iterations / 10; ++i) keep(f(i));
+		auto start = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < iterations; ++i) keep(f(i));
+		double ns = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - start).count();
+		double per = ns / iterations;
+		printf("%-36s %12.1f ns/op %14lu ops\n", name.c_str(), per,
+		       (unsigned long) iterations);
+		return per;
+	}
+
+protected:
+	static void keep(size_t value) {
+		static volatile size_t sink;
+		sink = sink + value;
+	}
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__BENCH__BENCH__H__
@@ -0,0 +1,196 @@
+/* load_bench: starts a WebServer on localhost over a MockBackend and drives
+ * it from client threads, each with its own session on one keep-alive
+ * connection. For each route mix it reports throughput and the p50, p99
+ * and p999 latency seen by the clients.
+ *
+ * Build next to the ib library, for example:
+ *   g++ -std=c++17 -O2 -I.. -I../.. load_bench.cc -lmicrohttpd -lz \
+ *       -pthread -o load_bench
+ * and run
+ *   ./load_bench config [seconds] [threads] [payload_bytes] [latency_us]
+ * where config is an ib config file for the server: it must set
+ * life_period and housekeeping_timeout_ms, and may set server_mode,
+ * server_threads and the other start_server options to compare them.
+ */
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/config.h"
+#include "centipede/bench/mock_backend.h"
+#include "centipede/metrics.h"
+#include "centipede/webserver.h"
+
+#define LOAD_BENCH_PORT 18080
+
+using namespace centipede;
+using namespace ib;
+using namespace std;
+
+/* Mix is a route mix: the percentage of requests of each kind, the rest
+ * being page loads. */
+struct Mix {
+	const char* name;
+	int get;
+	int set;
+	int command;
+	int call;
+};
+
+static const Mix mixes[] = {
+	{"page", 0, 0, 0, 0},
+	{"get", 100, 0, 0, 0},
+	{"set", 0, 100, 0, 0},
+	{"command", 0, 0, 100, 0},
+	{"call", 0, 0, 0, 100},
+	{"dashboard", 70, 10, 5, 5},
+};
+
+/* Client is one keep-alive HTTP/1.1 connection. */
+class Client {
+public:
+	Client() : _sock(-1) {}
+
+	~Client() {
+		if (_sock >= 0) close(_sock);
+	}
+
+	bool connect_to(int port) {
+		_sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (_sock < 0) return false;
+		int one = 1;
+		setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		return connect(_sock, (struct sockaddr*) &addr,
+			       sizeof(addr)) == 0;
+	}
+
+	/* get: sends a GET and reads the reply body into body. */
+	bool get(const string& url, string* body) {
+		string request = "GET " + url + " HTTP/1.1\r\n"
+			"Host: localhost\r\n\r\n";
+		if (send(_sock, request.data(), request.length(),
+			 MSG_NOSIGNAL) != (ssize_t) request.length()) {
+			return false;
+		}
+		size_t end;
+		while ((end = _in.find("\r\n\r\n")) == string::npos) {
+			if (!fill()) return false;
+		}
+		size_t length = content_length(_in.substr(0, end));
+		end += 4;
+		while (_in.length() < end + length) {
+			if (!fill()) return false;
+		}
+		body->assign(_in, end, length);
+		_in.erase(0, end + length);
+		return true;
+	}
+
+protected:
+	bool fill() {
+		char buf[65536];
+		ssize_t r = recv(_sock, buf, sizeof(buf), 0);
+		if (r <= 0) return false;
+		_in.append(buf, r);
+		return true;
+	}
+
+	static size_t content_length(string headers) {
+		for (auto& c : headers) c = tolower(c);
+		size_t pos = headers.find("content-length:");
+		if (pos == string::npos) return 0;
+		return strtoul(headers.c_str() + pos + 15, nullptr, 10);
+	}
+
+	int _sock;
+	string _in;
+};
+
+/* url: the next request of the mix for the client. */
+static string url(const Mix& mix, const string& prefix, uint64_t i) {
+	int roll = (i * 2654435761u) % 100;
+	if ((roll -= mix.get) < 0) return prefix + "/get/value/" +
+					 to_string(i % 8);
+	if ((roll -= mix.set) < 0) return prefix + "/set/value/" +
+					 to_string(i % 8);
+	if ((roll -= mix.command) < 0) return prefix + "/command/next";
+	if ((roll -= mix.call) < 0) return prefix + "/call/next";
+	return prefix;
+}
+
+static void run_mix(const Mix& mix, int seconds, int threads) {
+	LatencyHistogram latency;
+	atomic<uint64_t> errors(0);
+	atomic<bool> running(true);
+	vector<thread> clients;
+	for (int t = 0; t < threads; ++t) {
+		clients.emplace_back([&, t]() {
+			Client client;
+			string body;
+			if (!client.connect_to(LOAD_BENCH_PORT) ||
+			    !client.get("/", &body) ||
+			    body.compare(0, 4, "cid ")) {
+				++errors;
+				return;
+			}
+			string prefix = "/" + body.substr(
+				4, body.find('\n') - 4);
+			for (uint64_t i = t; running; i += threads) {
+				uint64_t start = Metrics::now();
+				if (!client.get(url(mix, prefix, i), &body)) {
+					++errors;
+					return;
+				}
+				latency.record(Metrics::now() - start);
+			}
+		});
+	}
+	this_thread::sleep_for(chrono::seconds(seconds));
+	running = false;
+	for (auto& x : clients) x.join();
+
+	printf("%-10s %10.0f req/s  p50 %6lu us  p99 %6lu us  "
+	       "p999 %6lu us  errors %lu\n",
+	       mix.name, (double) latency.count() / seconds,
+	       (unsigned long) latency.quantile(0.5),
+	       (unsigned long) latency.quantile(0.99),
+	       (unsigned long) latency.quantile(0.999),
+	       (unsigned long) errors.load());
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s config [seconds] [threads] "
+			"[payload_bytes] [latency_us]\n", argv[0]);
+		return 1;
+	}
+	Config::_()->load(argv[1]);
+	int seconds = argc > 2 ? atoi(argv[2]) : 5;
+	int threads = argc > 3 ? atoi(argv[3]) : 8;
+	size_t payload = argc > 4 ? atoi(argv[4]) : 4096;
+	int latency_us = argc > 5 ? atoi(argv[5]) : 0;
+
+	MockBackend backend(payload, latency_us);
+	WebServer server(&backend);
+	server.start_server(LOAD_BENCH_PORT);
+	printf("%d threads, %lu byte payload, %d us backend latency\n",
+	       threads, (unsigned long) payload, latency_us);
+	for (auto& mix : mixes) run_mix(mix, seconds, threads);
+	server.stop_server();
+	return 0;
+}
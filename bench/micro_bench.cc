@@ -0,0 +1,161 @@
+/* micro_bench: times the request path's building blocks in isolation.
+ *
+ * Build next to the ib library, for example:
+ *   g++ -std=c++17 -O2 -I.. -I../.. micro_bench.cc -lmicrohttpd -lz \
+ *       -pthread -o micro_bench
+ * and run ./micro_bench [scale], where scale multiplies the iterations.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/base_property_page.h"
+#include "centipede/bench/bench.h"
+#include "centipede/nodes/i_slot_page.h"
+#include "centipede/nodes/scaffold_node.h"
+#include "centipede/nodes/string_node.h"
+#include "centipede/output_sink.h"
+#include "centipede/session_store.h"
+#include "centipede/url_router.h"
+
+using namespace centipede;
+using namespace ib;
+using namespace std;
+
+/* url_parsing: ParsedUrl::parse, which replaced split_url. */
+static void url_parsing(uint64_t n) {
+	const string urls[] = {
+		"/",
+		"/8412345678901234567",
+		"/8412345678901234567/get/value/a/b",
+		"/8412345678901234567/command/for_a_node/node/cmd/x/y/z",
+	};
+	for (auto& url : urls) {
+		Bench::run("ParsedUrl::parse " + url.substr(0, 24), n,
+			   [&url](uint64_t) {
+			ParsedUrl pieces;
+			pieces.parse(url);
+			return pieces.size() + pieces.route();
+		});
+	}
+}
+
+static void string_nodes(uint64_t n) {
+	BasePropertyPage page;
+	StringNode leaf("leaf");
+	StringNode flat("<p>some text with no children at all</p>");
+	StringNode nested("<div>% and % and %</div>", &leaf, &leaf, &leaf);
+	nested.set_style("b i");
+	string output;
+	Bench::run("StringNode::display flat", n, [&](uint64_t) {
+		output.clear();
+		OutputSink out(&output);
+		flat.display(&page, &out);
+		return output.length();
+	});
+	Bench::run("StringNode::display nested+style", n, [&](uint64_t) {
+		output.clear();
+		OutputSink out(&output);
+		nested.display(&page, &out);
+		return output.length();
+	});
+	Bench::run("StringNode::display to string", n, [&](uint64_t) {
+		return static_cast<INode*>(&nested)->display(&page).length();
+	});
+}
+
+/* SlotPage keeps the bench's values by slot id as well, for the render
+ * that looks no names up. */
+class SlotPage : public BasePropertyPage, public ISlotPage {
+public:
+	void set_slot(const string& name, const string& value) {
+		size_t id = SlotIds::id(name);
+		if (id >= _slots.size()) _slots.resize(id + 1);
+		_slots[id] = value;
+	}
+
+	virtual const string* slot(int id) const {
+		if ((size_t) id >= _slots.size()) return nullptr;
+		return &_slots[id];
+	}
+
+protected:
+	vector<string> _slots;
+};
+
+static void scaffold_nodes(uint64_t n) {
+	char path[] = "/tmp/centipede_bench_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) return;
+	close(fd);
+	{
+		ofstream file(path);
+		for (int i = 0; i < 64; ++i) {
+			file << "<div class=\"row\">%%field" << i % 16
+			     << "%%</div>\n";
+		}
+	}
+	BasePropertyPage page;
+	ScaffoldNode node(path);
+	Bench::run("ScaffoldNode::load_file", n / 100, [&](uint64_t) {
+		node.load_file(path);
+		return (size_t) 1;
+	});
+	string output;
+	Bench::run("ScaffoldNode::display", n, [&](uint64_t) {
+		output.clear();
+		OutputSink out(&output);
+		node.display(&page, &out);
+		return output.length();
+	});
+	SlotPage slot_page;
+	for (int i = 0; i < 16; ++i) {
+		slot_page.set_slot("field" + to_string(i),
+				   "value " + to_string(i));
+	}
+	Bench::run("ScaffoldNode::display slot page", n, [&](uint64_t) {
+		output.clear();
+		OutputSink out(&output);
+		node.display(&slot_page, &out);
+		return output.length();
+	});
+	unlink(path);
+}
+
+/* sessions: what new_session and every request's session lookup cost,
+ * on a store of 100000 live sessions. */
+static void sessions(uint64_t n) {
+	SessionStore store;
+	store.set_life_period(600);
+	vector<ClientID> cids;
+	for (ClientID i = 1; i <= 100000; ++i) {
+		ClientID cid = i * 0x9E3779B97F4A7C15ULL;
+		if (store.create(cid, 0)) cids.push_back(cid);
+	}
+	ClientID next = 1;
+	Bench::run("SessionStore::create (new_session)", n, [&](uint64_t) {
+		ClientID cid = (next++) * 0xC2B2AE3D27D4EB4FULL;
+		return (size_t) store.create(cid, 0);
+	});
+	Bench::run("SessionStore::touch (lookup)", n, [&](uint64_t i) {
+		int state = 0;
+		store.touch(cids[i % cids.size()], 1, &state);
+		return (size_t) state;
+	});
+	Bench::run("SessionStore::touch (miss)", n, [&](uint64_t i) {
+		return (size_t) store.touch(i | 1, 1);
+	});
+}
+
+int main(int argc, char** argv) {
+	uint64_t n = 1000000;
+	if (argc > 1) n *= atof(argv[1]);
+	url_parsing(n);
+	string_nodes(n);
+	scaffold_nodes(n);
+	sessions(n);
+	return 0;
+}
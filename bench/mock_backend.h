@@ -0,0 +1,134 @@
+#ifndef __CENTIPEDE__BENCH__MOCK_BACKEND__H__
+#define __CENTIPEDE__BENCH__MOCK_BACKEND__H__
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "centipede/backend/i_webserver_backend.h"
+#include "centipede/output_sink.h"
+
+using namespace std;
+
+namespace centipede {
+
+/* MockBackend answers every request with a fixed payload after a fixed
+ * delay, which stands in for the work a real backend does. A page starts
+ * with "cid <cid>\n" so that a load generator can learn its ClientID from
+ * the first page it is served. */
+class MockBackend : public IWebserverBackend {
+public:
+	MockBackend(size_t payload_bytes, int latency_us)
+		: _payload(payload_bytes, 'x'), _latency_us(latency_us),
+		  _clients(0) {}
+
+	virtual ~MockBackend() {}
+
+	virtual void get_page(const ClientID& cid, int state,
+			      string* output) {
+		output->clear();
+		OutputSink out(output);
+		get_page(cid, state, &out);
+	}
+
+	virtual void get_page(const ClientID& cid, int state,
+			      OutputSink* out) {
+		work();
+		*out << "cid " << cid << "\n";
+		out->append(_payload);
+	}
+
+	virtual void get_resource(const ClientID&, const ResourceID&,
+				  const string&, string* output) {
+		work();
+		*output = _payload;
+	}
+
+	virtual bool get_value(const ClientID&, int state, const string&,
+			       const vector<string>&,
+			       const map<string, string>&, string* output) {
+		work();
+		*output = _payload;
+		return true;
+	}
+
+	virtual bool set_value(const ClientID&, int state, const string&,
+			       const vector<string>&,
+			       const map<string, string>&) {
+		work();
+		return true;
+	}
+
+	virtual int run_command(const ClientID&, int state, const string&,
+				const vector<string>&,
+				const map<string, string>&) {
+		work();
+		return state + 1;
+	}
+
+	/* the view overloads, which the webserver calls, answer the same
+	 * without copying the request's parameters */
+	virtual bool get_value(const ClientID&, int state, string_view,
+			       const ParameterViews&, const ArgumentViews&,
+			       OutputSink* output) {
+		work();
+		output->append(_payload);
+		return true;
+	}
+
+	virtual bool set_value(const ClientID&, int state, string_view,
+			       const ParameterViews&, const ArgumentViews&) {
+		work();
+		return true;
+	}
+
+	virtual int run_command(const ClientID&, int state, string_view,
+				const ParameterViews&, const ArgumentViews&) {
+		work();
+		return state + 1;
+	}
+
+	virtual void run_node_command(const ClientID&, int state,
+				      const string&, const string&,
+				      const vector<string>&,
+				      const map<string, string>&) {
+		work();
+	}
+
+	virtual int recv_post(const ClientID&, const string&, const string&,
+			      const string&, const string&, const string&,
+			      const string&, uint64_t, size_t,
+			      string* output) {
+		return 0;
+	}
+
+	virtual void new_client(const ClientID&) {
+		++_clients;
+	}
+
+	virtual void bye_client(const ClientID&) {
+		--_clients;
+	}
+
+	int clients() const {
+		return _clients;
+	}
+
+protected:
+	void work() {
+		if (_latency_us > 0) {
+			this_thread::sleep_for(
+				chrono::microseconds(_latency_us));
+		}
+	}
+
+	string _payload;
+	int _latency_us;
+	atomic<int> _clients;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__BENCH__MOCK_BACKEND__H__
@@ -0,0 +1,224 @@
+#ifndef __CENTIPEDE__COMPRESSION__H__
+#define __CENTIPEDE__COMPRESSION__H__
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <microhttpd.h>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+#define COMPRESSION_LEVEL 6
+#define COMPRESSION_MIN_BYTES 1024
+
+using namespace std;
+
+namespace centipede {
+
+enum Encoding {
+	IDENTITY = 0,
+	GZIP = 1,
+	DEFLATE = 2,
+	ENCODINGS = 3,
+};
+
+/* Compression negotiates Content-Encoding and compresses response bodies
+ * with zlib. Bodies shorter than min_bytes, or that do not shrink, are
+ * sent as they are. A negative level turns compression off; start_server
+ * takes a compression_level of zero as unset and uses COMPRESSION_LEVEL,
+ * so only a negative one disables it from the config. It counts the bytes
+ * compression has saved. */
+class Compression {
+public:
+	Compression() : _level(COMPRESSION_LEVEL),
+			_min_bytes(COMPRESSION_MIN_BYTES), _bytes_saved(0) {}
+
+	void set_level(int level) {
+		_level = level;
+	}
+
+	void set_min_bytes(size_t min_bytes) {
+		_min_bytes = min_bytes;
+	}
+
+	uint64_t bytes_saved() const {
+		return _bytes_saved;
+	}
+
+	/* negotiate: picks the encoding for a request, preferring gzip. An
+	 * encoding listed with q=0 is refused. */
+	Encoding negotiate(struct MHD_Connection* connection,
+			   size_t length) const {
+		if (_level <= 0 || length < _min_bytes) return IDENTITY;
+		const char* accept = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND,
+			MHD_HTTP_HEADER_ACCEPT_ENCODING);
+		if (!accept) return IDENTITY;
+		if (accepts(accept, "gzip")) return GZIP;
+		if (accepts(accept, "deflate")) return DEFLATE;
+		return IDENTITY;
+	}
+
+	/* compress: places the encoded data in output. Returns false if the
+	 * data does not get smaller. */
+	bool compress(const char* data, size_t length, Encoding encoding,
+		      string* output) const {
+		if (encoding == IDENTITY) return false;
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		int bits = encoding == GZIP ? 15 + 16 : 15;
+		if (deflateInit2(&zs, _level, Z_DEFLATED, bits, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK) return false;
+		output->resize(deflateBound(&zs, length));
+		zs.next_in = (Bytef*) data;
+		zs.avail_in = length;
+		zs.next_out = (Bytef*) &(*output)[0];
+		zs.avail_out = output->length();
+		int ret = deflate(&zs, Z_FINISH);
+		output->resize(zs.total_out);
+		deflateEnd(&zs);
+		return ret == Z_STREAM_END && output->length() < length;
+	}
+
+	/* create_response: builds a response for data already compressed
+	 * with encoding. */
+	static struct MHD_Response* create_response(const string& output,
+						    Encoding encoding) {
+		struct MHD_Response* response = MHD_create_response_from_buffer(
+			output.length(), (void *) output.data(),
+			MHD_RESPMEM_MUST_COPY);
+		if (!response) return nullptr;
+		MHD_add_response_header(response,
+					MHD_HTTP_HEADER_CONTENT_ENCODING,
+					encoding == GZIP ? "gzip" : "deflate");
+		MHD_add_response_header(response, MHD_HTTP_HEADER_VARY,
+					MHD_HTTP_HEADER_ACCEPT_ENCODING);
+		return response;
+	}
+
+	/* count: records a compressed response being sent. */
+	void count(size_t length, size_t compressed) {
+		if (compressed < length) _bytes_saved += length - compressed;
+	}
+
+protected:
+	/* accepts: whether the Accept-Encoding value lists name without
+	 * q=0. */
+	static bool accepts(const char* accept, const char* name) {
+		size_t len = strlen(name);
+		for (const char* p = accept; (p = strstr(p, name)); p += len) {
+			if (p != accept && p[-1] != ',' && p[-1] != ' ')
+				continue;
+			const char* end = p + len;
+			while (*end == ' ') ++end;
+			if (*end && *end != ',' && *end != ';') continue;
+			if (*end != ';') return true;
+			const char* q = strstr(end, "q=");
+			const char* next = strchr(end, ',');
+			if (!q || (next && q > next)) return true;
+			return strtod(q + 2, nullptr) > 0;
+		}
+		return false;
+	}
+
+	int _level;
+	size_t _min_bytes;
+	atomic<uint64_t> _bytes_saved;
+};
+
+/* EncodedResponses holds, for a body that is sent many times, one
+ * compressed response per encoding, each made on first use and carrying
+ * the headers set beforehand. */
+class EncodedResponses {
+public:
+	EncodedResponses() {
+		for (int i = 0; i < ENCODINGS; ++i) {
+			_responses[i] = nullptr;
+			_tried[i] = false;
+			_lengths[i] = 0;
+		}
+	}
+
+	~EncodedResponses() {
+		for (int i = 0; i < ENCODINGS; ++i) {
+			if (_responses[i]) MHD_destroy_response(_responses[i]);
+		}
+	}
+
+	/* add_header: must be called before the first get. */
+	void add_header(const string& name, const string& value) {
+		_headers.push_back(make_pair(name, value));
+	}
+
+	/* set_etag: gives each encoded response the ETag of its encoding,
+	 * as etag() makes it. Must be called before the first get. */
+	void set_etag(const string& etag) {
+		_etag = etag;
+	}
+
+	/* etag: the strong ETag of the encoding of a body whose identity
+	 * ETag is etag; an encoded body is a different representation, so
+	 * it must not share the identity's validator. */
+	static string etag(const string& etag, Encoding encoding) {
+		if (encoding == IDENTITY || etag.empty()) return etag;
+		string retval = etag;
+		size_t quote = retval.back() == '"' ? retval.length() - 1 :
+			retval.length();
+		retval.insert(quote, encoding == GZIP ? "-gz" : "-df");
+		return retval;
+	}
+
+	/* get: returns the response for encoding, or nullptr if the body is
+	 * better sent as it is. load(string*) supplies the body the first
+	 * time an encoding is asked for. Sets *compressed to the size of the
+	 * encoded body. */
+	template<typename F>
+	struct MHD_Response* get(Compression* compression, Encoding encoding,
+				 F load, size_t* compressed) {
+		unique_lock<mutex> ul(_mutex);
+		if (!_tried[encoding]) {
+			_tried[encoding] = true;
+			string data;
+			string output;
+			load(&data);
+			if (compression->compress(data.data(), data.length(),
+						  encoding, &output)) {
+				_lengths[encoding] = output.length();
+				_responses[encoding] =
+					Compression::create_response(
+						output, encoding);
+			}
+			if (_responses[encoding]) {
+				for (auto& x : _headers) {
+					MHD_add_response_header(
+						_responses[encoding],
+						x.first.c_str(),
+						x.second.c_str());
+				}
+				if (!_etag.empty()) {
+					MHD_add_response_header(
+						_responses[encoding],
+						MHD_HTTP_HEADER_ETAG,
+						etag(_etag, encoding).c_str());
+				}
+			}
+		}
+		*compressed = _lengths[encoding];
+		return _responses[encoding];
+	}
+
+protected:
+	mutex _mutex;
+	vector<pair<string, string>> _headers;
+	string _etag;
+	struct MHD_Response* _responses[ENCODINGS];
+	size_t _lengths[ENCODINGS];
+	bool _tried[ENCODINGS];
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__COMPRESSION__H__
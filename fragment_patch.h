@@ -0,0 +1,129 @@
+#ifndef __CENTIPEDE__FRAGMENT_PATCH__H__
+#define __CENTIPEDE__FRAGMENT_PATCH__H__
+
+#include <charconv>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "centipede/nodes/i_node.h"
+
+#define FRAGMENT_SINCE_ARG "since__"
+#define FRAGMENT_PATCH_MAGIC "centipede-patch "
+#define FRAGMENT_SCRIPT_URL "raw__/centipede_patch.js"
+
+using namespace std;
+
+namespace centipede {
+
+/* FragmentPatch is the reply to a command that carries the version the
+ * client's page is at, in the since__ argument, when only some fragment
+ * nodes have changed since:
+ *
+ *   centipede-patch <version>\n
+ *   <node id> <length>\n<html>\n		for each fragment
+ *
+ * where length counts the bytes of the html. The patch script served at
+ * /raw__/centipede_patch.js sends commands that way, through
+ * centipede.command("name/parameters?query"), and replaces each fragment
+ * in the page, or the whole document if the reply is a page instead.
+ */
+class FragmentPatch {
+public:
+	/* since: reads the since__ argument, returning false if there is no
+	 * valid one. */
+	template<typename Map>
+	static bool since(const Map& args, uint64_t* since) {
+		auto it = args.find(FRAGMENT_SINCE_ARG);
+		if (it == args.end()) return false;
+		const auto& value = it->second;
+		auto result = from_chars(value.data(),
+					 value.data() + value.length(), *since);
+		return result.ec == errc() &&
+			result.ptr == value.data() + value.length();
+	}
+
+	static void write(uint64_t version, const vector<Fragment>& fragments,
+			  string* output) {
+		size_t length = 32;
+		for (auto& x : fragments) length += x.html.length() + 32;
+		output->reserve(output->length() + length);
+		*output += FRAGMENT_PATCH_MAGIC;
+		*output += to_string(version);
+		*output += '\n';
+		for (auto& x : fragments) {
+			*output += to_string(x.id);
+			*output += ' ';
+			*output += to_string(x.html.length());
+			*output += '\n';
+			*output += x.html;
+			*output += '\n';
+		}
+	}
+
+	/* script: the client side, which keeps the version of its page as
+	 * the newest of the last patch and the data-version of its
+	 * fragments. */
+	static const char* script() {
+		return
+"var centipede = (function() {\n"
+"	var version = 0;\n"
+"	var magic = \"" FRAGMENT_PATCH_MAGIC "\";\n"
+"	function current() {\n"
+"		var v = version;\n"
+"		document.querySelectorAll(\"[data-version]\").forEach(\n"
+"			function(e) {\n"
+"				v = Math.max(v, +e.getAttribute(\"data-version\"));\n"
+"			});\n"
+"		return v;\n"
+"	}\n"
+"	function apply(bytes) {\n"
+"		var decoder = new TextDecoder();\n"
+"		var pos = 0;\n"
+"		function line() {\n"
+"			var end = bytes.indexOf(10, pos);\n"
+"			var words = decoder.decode(bytes.subarray(pos, end))\n"
+"				.split(\" \");\n"
+"			pos = end + 1;\n"
+"			return words;\n"
+"		}\n"
+"		version = +line()[1];\n"
+"		while (pos < bytes.length) {\n"
+"			var frame = line();\n"
+"			var length = +frame[1];\n"
+"			var html = decoder.decode(bytes.subarray(pos, pos + length));\n"
+"			pos += length + 1;\n"
+"			var node = document.querySelector(\n"
+"				\"[data-node=\\\"\" + frame[0] + \"\\\"]\");\n"
+"			if (node) node.outerHTML = html;\n"
+"		}\n"
+"	}\n"
+"	function command(path) {\n"
+"		var cid = location.pathname.split(\"/\")[1];\n"
+"		var url = \"/\" + cid + \"/command/\" + path;\n"
+"		url += (url.indexOf(\"?\") < 0 ? \"?\" : \"&\") +\n"
+"			\"" FRAGMENT_SINCE_ARG "=\" + current();\n"
+"		return fetch(url).then(function(reply) {\n"
+"			return reply.arrayBuffer();\n"
+"		}).then(function(buffer) {\n"
+"			var bytes = new Uint8Array(buffer);\n"
+"			var text = new TextDecoder();\n"
+"			if (text.decode(bytes.subarray(0, magic.length)) == magic) {\n"
+"				apply(bytes);\n"
+"				return;\n"
+"			}\n"
+"			version = 0;\n"
+"			document.open();\n"
+"			document.write(text.decode(bytes));\n"
+"			document.close();\n"
+"		});\n"
+"	}\n"
+"	return {command: command};\n"
+"})();\n";
+	}
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__FRAGMENT_PATCH__H__
@@ -0,0 +1,312 @@
+#ifndef __CENTIPEDE__METRICS__H__
+#define __CENTIPEDE__METRICS__H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS (35 * LATENCY_SUB_BUCKETS)
+#define LATENCY_STRIPES 8
+
+namespace centipede {
+
+/* LatencyHistogram counts durations in microseconds in log-linear buckets,
+ * in the manner of an HDR histogram: every power of two is split into
+ * LATENCY_SUB_BUCKETS equal buckets, so any value is known to within an
+ * eighth. Recording is two relaxed atomic increments and never locks. The
+ * counters are striped over LATENCY_STRIPES cache lines, each thread
+ * taking one, so threads recording at once rarely share a line; the
+ * stripes, and the count, are only summed when read. */
+class LatencyHistogram {
+public:
+	LatencyHistogram() {
+		for (auto& x : _stripes) {
+			for (auto& y : x.buckets) y = 0;
+			x.sum = 0;
+		}
+	}
+
+	void record(uint64_t us) {
+		Stripe& s = _stripes[stripe()];
+		s.buckets[index(us)].fetch_add(1, memory_order_relaxed);
+		s.sum.fetch_add(us, memory_order_relaxed);
+	}
+
+	uint64_t count() const {
+		uint64_t retval = 0;
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i) retval += bucket(i);
+		return retval;
+	}
+
+	uint64_t sum() const {
+		uint64_t retval = 0;
+		for (auto& x : _stripes) retval += x.sum.load(memory_order_relaxed);
+		return retval;
+	}
+
+	/* below: the number of values under limit, which must be a power of
+	 * two, as the buckets are aligned to them. */
+	uint64_t below(uint64_t limit) const {
+		uint64_t retval = 0;
+		for (size_t i = 0; i < LATENCY_BUCKETS && upper(i) <= limit; ++i)
+			retval += bucket(i);
+		return retval;
+	}
+
+	/* quantile: the upper bound of the bucket holding quantile q. */
+	uint64_t quantile(double q) const {
+		uint64_t total = 0;
+		uint64_t counts[LATENCY_BUCKETS];
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+			counts[i] = bucket(i);
+			total += counts[i];
+		}
+		if (!total) return 0;
+		uint64_t rank = q * total;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+			seen += counts[i];
+			if (seen > rank) return upper(i);
+		}
+		return upper(LATENCY_BUCKETS - 1);
+	}
+
+protected:
+	struct alignas(64) Stripe {
+		atomic<uint64_t> buckets[LATENCY_BUCKETS];
+		atomic<uint64_t> sum;
+	};
+
+	/* stripe: the calling thread's stripe, handed out in turn. */
+	static size_t stripe() {
+		static atomic<size_t> next(0);
+		thread_local size_t stripe = next.fetch_add(
+			1, memory_order_relaxed) % LATENCY_STRIPES;
+		return stripe;
+	}
+
+	uint64_t bucket(size_t i) const {
+		uint64_t retval = 0;
+		for (auto& x : _stripes)
+			retval += x.buckets[i].load(memory_order_relaxed);
+		return retval;
+	}
+
+	static size_t index(uint64_t us) {
+		if (us < LATENCY_SUB_BUCKETS) return us;
+		int e = 63 - __builtin_clzll(us);
+		size_t i = (e - 2) * LATENCY_SUB_BUCKETS +
+			((us >> (e - 3)) & (LATENCY_SUB_BUCKETS - 1));
+		return i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1;
+	}
+
+	/* upper: the exclusive upper bound of bucket i. */
+	static uint64_t upper(size_t i) {
+		if (i < LATENCY_SUB_BUCKETS) return i + 1;
+		int e = i / LATENCY_SUB_BUCKETS + 2;
+		uint64_t m = i % LATENCY_SUB_BUCKETS;
+		return (LATENCY_SUB_BUCKETS + m + 1) << (e - 3);
+	}
+
+	Stripe _stripes[LATENCY_STRIPES];
+};
+
+/* MetricRoute is the kind of request a latency is filed under. */
+enum MetricRoute {
+	METRIC_RAW,
+	METRIC_NEW_SESSION,
+	METRIC_PAGE,
+	METRIC_GET,
+	METRIC_SET,
+	METRIC_RESOURCE,
+	METRIC_COMMAND,
+	METRIC_CALL,
+	METRIC_FOR_A_NODE,
+	METRIC_POST,
+	METRIC_BATCH,
+	METRIC_ROUTES,
+};
+
+/* BackendMethod is the IWebserverBackend method a latency is filed under.
+ * The _async methods count the time until they return. */
+enum BackendMethod {
+	BACKEND_GET_PAGE,
+	BACKEND_PAGE_VERSION,
+	BACKEND_GET_VALUE,
+	BACKEND_SET_VALUE,
+	BACKEND_GET_RESOURCE,
+	BACKEND_RUN_COMMAND,
+	BACKEND_RUN_NODE_COMMAND,
+	BACKEND_OPEN_UPLOAD,
+	BACKEND_NEW_CLIENT,
+	BACKEND_BYE_CLIENT,
+	BACKEND_GET_FRAGMENTS,
+	BACKEND_OPEN_RESOURCE,
+	BACKEND_METHODS,
+};
+
+/* Metrics gathers the webserver's counters and latency histograms and
+ * writes them out in the Prometheus text format. */
+class Metrics {
+public:
+	Metrics() : _evictions(0), _bytes_sent(0), _rejected(0) {}
+
+	/* now: a monotonic time in microseconds for timing with. */
+	static uint64_t now() {
+		return chrono::duration_cast<chrono::microseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void route(MetricRoute route, uint64_t start) {
+		_routes[route].record(now() - start);
+	}
+
+	void backend(BackendMethod method, uint64_t start) {
+		_backend[method].record(now() - start);
+	}
+
+	void evicted(size_t clients) {
+		_evictions.fetch_add(clients, memory_order_relaxed);
+	}
+
+	void sent(size_t bytes) {
+		_bytes_sent.fetch_add(bytes, memory_order_relaxed);
+	}
+
+	void rejected() {
+		_rejected.fetch_add(1, memory_order_relaxed);
+	}
+
+	/* State is what the owner of the Metrics knows at scrape time. */
+	struct State {
+		size_t sessions;
+		uint64_t lock_acquisitions;
+		uint64_t lock_contended;
+		uint64_t lock_wait_us;
+		uint64_t bytes_saved;
+	};
+
+	void format(const State& state, string* output) const {
+		static const char* routes[METRIC_ROUTES] = {
+			"raw", "new_session", "page", "get", "set", "resource",
+			"command", "call", "for_a_node", "post", "batch",
+		};
+		static const char* methods[BACKEND_METHODS] = {
+			"get_page", "page_version", "get_value", "set_value",
+			"get_resource", "run_command", "run_node_command",
+			"open_upload", "new_client", "bye_client",
+			"get_fragments", "open_resource",
+		};
+		histograms("centipede_request_seconds",
+			   "Time to serve a request, by route.", "route",
+			   routes, _routes, METRIC_ROUTES, output);
+		histograms("centipede_backend_seconds",
+			   "Time spent in backend methods.", "method",
+			   methods, _backend, BACKEND_METHODS, output);
+		counter("centipede_sessions", "gauge",
+			"Live client sessions.", state.sessions, output);
+		counter("centipede_evictions_total", "counter",
+			"Sessions ended by expiry or eviction.",
+			_evictions.load(memory_order_relaxed), output);
+		counter("centipede_sent_bytes_total", "counter",
+			"Response body bytes queued.",
+			_bytes_sent.load(memory_order_relaxed), output);
+		counter("centipede_rejected_total", "counter",
+			"Requests refused by admission control.",
+			_rejected.load(memory_order_relaxed), output);
+		counter("centipede_compression_saved_bytes_total", "counter",
+			"Bytes saved by compressing responses.",
+			state.bytes_saved, output);
+		counter("centipede_session_lock_acquisitions_total", "counter",
+			"Session shard lock acquisitions.",
+			state.lock_acquisitions, output);
+		counter("centipede_session_lock_contended_total", "counter",
+			"Session shard lock acquisitions that had to wait.",
+			state.lock_contended, output);
+		*output += "# HELP centipede_session_lock_wait_seconds_total "
+			"Time spent waiting for session shard locks.\n"
+			"# TYPE centipede_session_lock_wait_seconds_total "
+			"counter\ncentipede_session_lock_wait_seconds_total ";
+		*output += seconds(state.lock_wait_us);
+		*output += '\n';
+	}
+
+protected:
+	static string seconds(uint64_t us) {
+		return to_string(us / 1000000) + "." +
+			to_string(1000000 + us % 1000000).substr(1);
+	}
+
+	static void counter(const string& name, const string& type,
+			    const string& help, uint64_t value, string* output) {
+		*output += "# HELP " + name + " " + help + "\n";
+		*output += "# TYPE " + name + " " + type + "\n";
+		*output += name + " " + to_string(value) + "\n";
+	}
+
+	/* histograms: writes buckets at every power of two microseconds up to
+	 * about a minute, and the 0.5, 0.99 and 0.999 quantiles as gauges. */
+	static void histograms(const string& name, const string& help,
+			       const string& label, const char** values,
+			       const LatencyHistogram* histograms, size_t n,
+			       string* output) {
+		*output += "# HELP " + name + " " + help + "\n";
+		*output += "# TYPE " + name + " histogram\n";
+		for (size_t i = 0; i < n; ++i) {
+			const LatencyHistogram& h = histograms[i];
+			string tag = label + "=\"" + values[i] + "\"";
+			for (int k = 0; k <= 26; ++k) {
+				*output += name + "_bucket{" + tag + ",le=\"" +
+					seconds(1ULL << k) + "\"} " +
+					to_string(h.below(1ULL << k)) + "\n";
+			}
+			*output += name + "_bucket{" + tag + ",le=\"+Inf\"} " +
+				to_string(h.count()) + "\n";
+			*output += name + "_sum{" + tag + "} " +
+				seconds(h.sum()) + "\n";
+			*output += name + "_count{" + tag + "} " +
+				to_string(h.count()) + "\n";
+		}
+		string quantiles = name + "_quantile";
+		*output += "# TYPE " + quantiles + " gauge\n";
+		for (size_t i = 0; i < n; ++i) {
+			for (const char* q : {"0.5", "0.99", "0.999"}) {
+				*output += quantiles + "{" + label + "=\"" +
+					values[i] + "\",quantile=\"" + q +
+					"\"} " + seconds(histograms[i].quantile(
+						stod(q))) + "\n";
+			}
+		}
+	}
+
+	LatencyHistogram _routes[METRIC_ROUTES];
+	LatencyHistogram _backend[BACKEND_METHODS];
+	atomic<uint64_t> _evictions;
+	atomic<uint64_t> _bytes_sent;
+	atomic<uint64_t> _rejected;
+};
+
+/* BackendTimer files the time until it goes out of scope under a backend
+ * method. */
+class BackendTimer {
+public:
+	BackendTimer(Metrics* metrics, BackendMethod method)
+		: _metrics(metrics), _method(method), _start(Metrics::now()) {}
+
+	~BackendTimer() {
+		_metrics->backend(_method, _start);
+	}
+
+protected:
+	Metrics* _metrics;
+	BackendMethod _method;
+	uint64_t _start;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__METRICS__H__
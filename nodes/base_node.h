@@ -1,7 +1,9 @@
 #ifndef __IB__WEB__BASE_NODE__H__
 #define __IB__WEB__BASE_NODE__H__
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <sstream>
 #include <string>
 
@@ -13,13 +15,25 @@ using namespace std;
 
 namespace centipede {
 
+/* BaseNode gives every node an id and a version, taken from a clock shared
+ * by all nodes that ticks on every change. A node marked as a fragment is
+ * rendered inside a <div data-node=id data-version=version> with
+ * display:contents, so that the patch script can replace it alone when a
+ * command changes nothing else on the page.
+ *
+ * Versions cover the node's own text, style and children; a node that
+ * also renders something else, such as page values, must be touch()ed by
+ * the backend when that changes.
+ */
 class BaseNode : public INode {
 public:
 	BaseNode() : BaseNode("") {}
-	BaseNode(const string& text) : _text(text) {}
+	BaseNode(const string& text) : _text(text), _id(next_id()),
+		_version(now()), _fragment(false) {}
 	virtual ~BaseNode() {}
 	virtual void set_text(const string& text) {
 		_text = text;
+		touch();
 	}
 	virtual void set_name(const string& name) {
 		_name = name;
@@ -41,15 +55,20 @@ public:
 	}
 
 	virtual string display(AbstractPropertyPage* app) {
-		stringstream ss;
-		display(app, &ss);
-		return ss.str();
+		string output;
+		OutputSink out(&output);
+		display(app, &out);
+		return output;
 	}
 
 	virtual void display(AbstractPropertyPage* app, stringstream* ss) {
 		assert(0);
 	}
 
+	virtual void display(AbstractPropertyPage* app, OutputSink* out) {
+		INode::display(app, out);
+	}
+
         virtual void clear_style() {
 		assert(0);
 	}
@@ -58,9 +77,84 @@ public:
 		assert(0);
 	}
 
+	virtual uint64_t id() {
+		return _id;
+	}
+
+	virtual uint64_t version() {
+		return _version;
+	}
+
+	/* touch: marks the node changed. */
+	void touch() {
+		_version = tick();
+	}
+
+	/* set_fragment: whether the node is rendered, and can be sent, as a
+	 * fragment of its own. */
+	void set_fragment(bool fragment) {
+		_fragment = fragment;
+		touch();
+	}
+
+	bool fragment() const {
+		return _fragment;
+	}
+
+	virtual bool fragments(AbstractPropertyPage* app, uint64_t since,
+			       vector<Fragment>* output) {
+		if (!_fragment) return _version <= since;
+		if (_version > since) add_fragment(app, output);
+		return true;
+	}
+
+	/* now: the clock's current reading. A version read before rendering
+	 * is one the render is at least as new as. */
+	static uint64_t now() {
+		return clock().load(memory_order_acquire);
+	}
+
+	/* tick: advances the clock, returning a version newer than any
+	 * before, for changes made outside of a node. */
+	static uint64_t tick() {
+		return clock().fetch_add(1, memory_order_acq_rel) + 1;
+	}
+
 protected:
+	static atomic<uint64_t>& clock() {
+		static atomic<uint64_t> clock(1);
+		return clock;
+	}
+
+	static uint64_t next_id() {
+		static atomic<uint64_t> ids(0);
+		return ++ids;
+	}
+
+	/* add_fragment: renders the node, wrapper and all, as a fragment. */
+	void add_fragment(AbstractPropertyPage* app, vector<Fragment>* output) {
+		output->push_back({_id, ""});
+		OutputSink out(&output->back().html);
+		display(app, &out);
+	}
+
+	/* open_fragment: writes the wrapper of a fragment node, if this is
+	 * one. */
+	void open_fragment(OutputSink* out) {
+		if (!_fragment) return;
+		*out << "<div data-node=\"" << _id << "\" data-version=\""
+		     << version() << "\" style=\"display:contents\">";
+	}
+
+	void close_fragment(OutputSink* out) {
+		if (_fragment) *out << "</div>";
+	}
+
 	string _name;
 	string _text;
+	uint64_t _id;
+	uint64_t _version;
+	bool _fragment;
 };
 
 }  // namespace centipede
@@ -7,6 +7,7 @@
 
 #include "ib/abstract_property_page.h"
 #include "ib/logger.h"
+#include "centipede/output_sink.h"
 #include "centipede/types.h"
 
 using namespace std;
@@ -14,12 +15,28 @@ using namespace ib;
 
 namespace centipede {
 
+/* Fragment is the render of one fragment node, wrapper included, sent in
+ * place of the whole page when only it has changed. */
+struct Fragment {
+	uint64_t id;
+	string html;
+};
+
 class INode {
 public:
 	virtual ~INode() {}
 	virtual string display(const ClientID& cid) = 0;
 	virtual string display(AbstractPropertyPage* app) = 0;
 	virtual void display(AbstractPropertyPage* app, stringstream* ss) = 0;
+
+	/* display: the primary way to render a node. By default it adapts
+	 * the stringstream overload, so nodes written against that still
+	 * work; nodes on the render path should override this one. */
+	virtual void display(AbstractPropertyPage* app, OutputSink* out) {
+		stringstream ss;
+		display(app, &ss);
+		out->append(ss.str());
+	}
 	virtual void set_name(const string& name) = 0;
 	virtual const string& name() = 0;
 	virtual void handle_command(const ClientID& cid,
@@ -28,6 +45,27 @@ public:
 				    AbstractPropertyPage* args) = 0;
 	virtual void clear_style() = 0;
 	virtual void set_style(const string&) = 0;
+
+	/* id: a number naming the node for the life of the process, or zero
+	 * for nodes that cannot be rendered as fragments. */
+	virtual uint64_t id() {
+		return 0;
+	}
+
+	/* version: the latest change to the node or anything below it, on
+	 * the clock of BaseNode::now(). A node that does not track changes
+	 * is always newer than any version. */
+	virtual uint64_t version() {
+		return ~0ULL;
+	}
+
+	/* fragments: appends the fragments below the node, itself included,
+	 * changed after since. Returns false if something changed outside of
+	 * every fragment, so that only a render of the whole page will do. */
+	virtual bool fragments(AbstractPropertyPage* app, uint64_t since,
+			       vector<Fragment>* output) {
+		return version() <= since;
+	}
 };
 
 }  // namespace centipede
@@ -0,0 +1,42 @@
+#ifndef __CENTIPEDE__I_SLOT_PAGE__H__
+#define __CENTIPEDE__I_SLOT_PAGE__H__
+
+#include <map>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+namespace centipede {
+
+/* SlotIds numbers the names of template slots, the same name always
+ * getting the same id for the life of the process. Templates take the ids
+ * of their slots when parsed, and pages those of their values when bound,
+ * so that a render never looks a name up. */
+class SlotIds {
+public:
+	static int id(const string& name) {
+		static mutex ids_mutex;
+		static map<string, int> ids;
+		lock_guard<mutex> lock(ids_mutex);
+		auto it = ids.find(name);
+		if (it != ids.end()) return it->second;
+		int retval = ids.size();
+		ids.emplace(name, retval);
+		return retval;
+	}
+};
+
+/* ISlotPage is implemented by a property page that also keeps its values
+ * by SlotIds id. A ScaffoldTemplate renders from such a page without
+ * looking names up or copying values: slot returns the value for an id,
+ * valid until the page changes, or nullptr if the page has none. */
+class ISlotPage {
+public:
+	virtual ~ISlotPage() {}
+	virtual const string* slot(int id) const = 0;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__I_SLOT_PAGE__H__
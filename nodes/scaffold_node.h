@@ -1,76 +1,84 @@
 #ifndef __CENTIPEDE__SCAFFOLD_NODE__H__
 #define __CENTIPEDE__SCAFFOLD_NODE__H__
 
+#include <algorithm>
 #include <cassert>
-#include <cstring>
 #include <sstream>
 #include <string>
 
 #include "ib/abstract_property_page.h"
 #include "ib/logger.h"
 #include "centipede/nodes/base_node.h"
+#include "centipede/nodes/scaffold_template.h"
 #include "centipede/nodes/string_node.h"
+#include "centipede/nodes/template_registry.h"
 
 using namespace std;
 
 namespace centipede {
 
+/* ScaffoldNode renders a ScaffoldTemplate. One loaded from a file is held
+ * by the TemplateRegistry and follows the file as it is edited. */
 class ScaffoldNode : public StringNode {
 public:
 	ScaffoldNode() : ScaffoldNode("") {}
-	ScaffoldNode(const string& file) : StringNode("") {
+	ScaffoldNode(const string& file) : StringNode(""), _slot(nullptr) {
 		if (!file.empty()) load_file(file);
 	}
 
 	virtual void display(AbstractPropertyPage* app,
 			     stringstream* ss) {
-		bool to_fill = false;
-		for (auto &x: _pieces) {
-			if (to_fill) {
-				/*if (x[0] == '@') {
-					Nodes::_()->get_node(
-						x.substr(1))->display(app, ss);
-				} else*/
-				if (app->has(x)) *ss << app->get(x);
-				else *ss << "%%" << x << "%%";
-			} else *ss << x;
-			to_fill = !to_fill;
+		string output;
+		OutputSink out(&output);
+		display(app, &out);
+		ss->write(output.data(), output.length());
+	}
+
+	virtual void display(AbstractPropertyPage* app, OutputSink* out) {
+		open_fragment(out);
+		if (_slot) {
+			TemplateReader reader(_slot);
+			reader->parsed.render(app, out);
 		}
+		close_fragment(out);
+	}
+
+	/* version: also the version of the file last loaded. */
+	virtual uint64_t version() {
+		if (!_slot) return _version;
+		TemplateReader reader(_slot);
+		return max(_version, reader->version);
 	}
 
         virtual string display(AbstractPropertyPage* app) {
-                stringstream ss;
-                display(app, &ss);
-                return ss.str();
+		string output;
+		OutputSink out(&output);
+		display(app, &out);
+		return output;
         }
 
+	/* load_file: renders file from now on. A file already loaded by any
+	 * node is shared, and kept current by the registry. A file that
+	 * cannot be read is logged and leaves the node as it was. */
 	virtual void load_file(const string& file) {
-		ifstream fin(file);
-		assert(fin.good());
-		fin.seekg(0, ios::end);
-		size_t length = fin.tellg();
-		fin.seekg(0, ios::beg);
-		unique_ptr<char[]> buf(new char[length + 1]);
-		Logger::info("(scaffold_node) file % has len %", file, length);
-		fin.read(buf.get(), length);
-		buf.get()[length] = 0;
-		fin.close();
-		char* save_ptr;
-		char* token;
-		char* str = buf.get();
-		while ((token = strtok_r(str, "%%", &save_ptr))) {
-			_pieces.push_back(token);
-			str = nullptr;
+		TemplateSlot* slot = TemplateRegistry::_()->watch(file);
+		if (!slot) {
+			Logger::error("(scaffold_node) cannot load %", file);
+			return;
 		}
+		_slot = slot;
+		touch();
 	}
 
 	virtual void clear() {
 		_text = "";
-		_pieces.clear();
+		_slot = nullptr;
+		compile();
+		touch();
 	}
 
 protected:
-	vector<string> _pieces;
+	TemplateSlot* _slot;
 };
 
 }  // namespace centipede
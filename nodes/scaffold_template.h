@@ -0,0 +1,144 @@
+#ifndef __CENTIPEDE__SCAFFOLD_TEMPLATE__H__
+#define __CENTIPEDE__SCAFFOLD_TEMPLATE__H__
+
+#include <string>
+#include <vector>
+
+#include "ib/abstract_property_page.h"
+#include "centipede/nodes/i_slot_page.h"
+#include "centipede/output_sink.h"
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* ScaffoldTemplate is the parsed form of a scaffold file. The text is a
+ * sequence of literals and %%name%% slots. Parsing stores every literal
+ * in one buffer, binds each slot to its SlotIds id, and keeps the
+ * %%name%% text written for a slot the page lacks in a second buffer. A
+ * page that is an ISlotPage is rendered by id, with no lookup and no
+ * allocation beyond sizing the output once; any other page can only be
+ * asked by name. A %% without a closing %% is literal text. */
+class ScaffoldTemplate {
+public:
+	ScaffoldTemplate() {}
+	ScaffoldTemplate(const string& text) {
+		parse(text);
+	}
+
+	void parse(const string& text) {
+		clear();
+		size_t pos = 0;
+		while (true) {
+			size_t open = text.find("%%", pos);
+			size_t close = open == string::npos ?
+				string::npos : text.find("%%", open + 2);
+			if (close == string::npos) {
+				add_literal(text, pos, text.length() - pos);
+				break;
+			}
+			add_literal(text, pos, open - pos);
+			add_slot(text.substr(open + 2, close - open - 2));
+			pos = close + 2;
+		}
+	}
+
+	void clear() {
+		_literals.clear();
+		_fallbacks.clear();
+		_pieces.clear();
+		_names.clear();
+	}
+
+	/* render: appends the template to output, filling each slot from
+	 * app. Slots app does not have are written back as %%name%%. */
+	void render(AbstractPropertyPage* app, OutputSink* output) const {
+		const ISlotPage* page = dynamic_cast<const ISlotPage*>(app);
+		if (page) {
+			render_slots(page, output);
+			return;
+		}
+		for (auto& x : _pieces) {
+			if (x.slot < 0) {
+				output->append(_literals.data() + x.offset,
+					       x.length);
+			} else if (app->has(_names[x.name])) {
+				output->append(app->get(_names[x.name]));
+			} else {
+				output->append(_fallbacks.data() + x.offset,
+					       x.length);
+			}
+		}
+	}
+
+	/* literal_length: the number of bytes a render writes besides the
+	 * slot values. */
+	size_t literal_length() const {
+		return _literals.length();
+	}
+
+	/* names: the distinct slot names. */
+	const vector<string>& names() const {
+		return _names;
+	}
+
+protected:
+	/* Piece is either a span of _literals or, if slot is not negative,
+	 * the SlotIds id of a slot, with its %%name%% span of _fallbacks and
+	 * the index of its name in _names. */
+	struct Piece {
+		size_t offset;
+		size_t length;
+		int slot;
+		int name;
+	};
+
+	/* render_slots: the render from a page holding its values by id,
+	 * into an output sized once for the whole template. */
+	void render_slots(const ISlotPage* page, OutputSink* output) const {
+		size_t length = _literals.length();
+		for (auto& x : _pieces) {
+			if (x.slot < 0) continue;
+			const string* value = page->slot(x.slot);
+			length += value ? value->length() : x.length;
+		}
+		output->reserve(length);
+		for (auto& x : _pieces) {
+			if (x.slot < 0) {
+				output->append(_literals.data() + x.offset,
+					       x.length);
+				continue;
+			}
+			const string* value = page->slot(x.slot);
+			if (value) output->append(*value);
+			else output->append(_fallbacks.data() + x.offset,
+					    x.length);
+		}
+	}
+
+	void add_literal(const string& text, size_t pos, size_t length) {
+		if (!length) return;
+		_pieces.push_back({_literals.length(), length, -1, -1});
+		_literals.append(text, pos, length);
+	}
+
+	void add_slot(const string& name) {
+		int index = 0;
+		while (index < (int) _names.size() && _names[index] != name)
+			++index;
+		if (index == (int) _names.size()) _names.push_back(name);
+		_pieces.push_back({_fallbacks.length(), name.length() + 4,
+				   SlotIds::id(name), index});
+		_fallbacks.append("%%").append(name).append("%%");
+	}
+
+	string _literals;
+	string _fallbacks;
+	vector<Piece> _pieces;
+	vector<string> _names;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__SCAFFOLD_TEMPLATE__H__
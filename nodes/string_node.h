@@ -4,6 +4,7 @@
 #include <cassert>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "centipede/nodes/base_node.h"
 #include "centipede/nodes/i_node.h"
@@ -12,15 +13,24 @@ using namespace std;
 
 namespace centipede {
 
+/* StringNode renders a format string in which each % is replaced by the
+ * next child node and %% is a literal %, wrapped in the html tags named
+ * by its style. The format and style are compiled whenever they change
+ * into literal runs, child references and prebuilt tag strings, so that a
+ * render is a sequence of appends. */
 class StringNode : public BaseNode {
 public:
 	StringNode() : StringNode("") {}
-	StringNode(const string& init) { _text = init; }
+	StringNode(const string& init) {
+		_text = init;
+		compile();
+	}
 
 	template<typename... Args>
 	StringNode(const string& format, Args... args) {
 		_text = format;
 		fold(args...);
+		compile();
 	}
 protected:
 	template<typename... Args>
@@ -36,57 +46,143 @@ public:
 	virtual ~StringNode() {}
 	virtual void set(const string& text) {
 		_text = text;
+		compile();
+		touch();
 	}
 
 	virtual void display(AbstractPropertyPage* app, stringstream* ss) {
 		assert(ss);
-		if (_style.empty())
-			display_text(app, ss);
-		else {
-			stringstream is;
-			is << _style;
-			string token;
-			vector<string> tokens;
-			while (is.good()) {
-				is >> token;
-				*ss << "<" + token + ">";
-				tokens.push_back(token);
-			}
-			display_text(app, ss);
-			while (!tokens.empty()) {
-				token = tokens.back();
-				*ss << "</" + token + ">";
-				tokens.pop_back();
-			}
+		string output;
+		OutputSink out(&output);
+		display(app, &out);
+		ss->write(output.data(), output.length());
+	}
 
+	virtual void display(AbstractPropertyPage* app, OutputSink* out) {
+		assert(out);
+		open_fragment(out);
+		out->append(_open_tags);
+		for (auto& x : _segments) {
+			if (x.child < 0) {
+				out->append(_literals.data() + x.offset, x.length);
+			} else if (x.child < (int) _args.size()) {
+				_args[x.child]->display(app, out);
+			}
 		}
+		out->append(_close_tags);
+		close_fragment(out);
 	}
 
 	virtual void set_style(const string& style) {
 		_style = style;
+		compile_style();
+		touch();
 	}
 
-protected:
+	/* version: the newest of the node's own and its children's. */
+	virtual uint64_t version() {
+		uint64_t version = _version;
+		for (auto& x : _args) version = max(version, x->version());
+		return version;
+	}
+
+	/* fragments: a fragment whose own text changed, or with a change
+	 * below it that no smaller fragment covers, is sent whole, in place
+	 * of whatever its children had added. */
+	virtual bool fragments(AbstractPropertyPage* app, uint64_t since,
+			       vector<Fragment>* output) {
+		size_t mark = output->size();
+		if (_version <= since) {
+			bool whole = false;
+			for (auto& x : _args) {
+				if (!x->fragments(app, since, output)) {
+					whole = true;
+					break;
+				}
+			}
+			if (!whole) return true;
+			output->resize(mark);
+		}
+		if (!_fragment) return false;
+		add_fragment(app, output);
+		return true;
+	}
 
-	void display_text(AbstractPropertyPage* app, stringstream* ss) {
-		auto x = _args.begin();
+protected:
+	/* Segment is a span of _literals, or a child if child is not
+	 * negative. */
+	struct Segment {
+		size_t offset;
+		size_t length;
+		int child;
+	};
+
+	/* compile: rebuilds the segments from _text. Must be called again by
+	 * subclasses that change _text or _args directly. A format with more
+	 * placeholders than children is logged, and the extra placeholders
+	 * render as nothing. */
+	void compile() {
+		_literals.clear();
+		_segments.clear();
+		int children = 0;
+		size_t run = 0;
 		const char* format = _text.c_str();
 		while (*format) {
 			if (*format == '%') {
 				if (*(format + 1) != '%') {
-					(*x++)->display(app, ss);
+					end_run(&run);
+					_segments.push_back({0, 0, children++});
 				} else {
-					*ss << "%";
+					_literals.push_back('%');
+					++run;
 					++format;
 				}
 				++format;
-			} else *ss << *format++;
+			} else {
+				_literals.push_back(*format++);
+				++run;
+			}
 		}
+		end_run(&run);
+		if (children > (int) _args.size()) {
+			Logger::error("(string_node) format \"%\" has % "
+				      "placeholders but % children",
+				      _text, children, _args.size());
+		}
+		compile_style();
+	}
+
+	void compile_style() {
+		_open_tags.clear();
+		_close_tags.clear();
+		stringstream is(_style);
+		string token;
+		vector<string> tokens;
+		while (is >> token) {
+			_open_tags += "<" + token + ">";
+			tokens.push_back(token);
+		}
+		while (!tokens.empty()) {
+			_close_tags += "</" + tokens.back() + ">";
+			tokens.pop_back();
+		}
+	}
+
+	/* end_run: closes the literal run of the last run bytes. */
+	void end_run(size_t* run) {
+		if (!*run) return;
+		_segments.push_back({_literals.length() - *run, *run, -1});
+		*run = 0;
 	}
 
 	string _text;
 	string _style;
 	vector<INode*> _args;
+
+	string _literals;
+	vector<Segment> _segments;
+	string _open_tags;
+	string _close_tags;
 };
 
 }  // namespace centipede
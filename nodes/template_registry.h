@@ -0,0 +1,291 @@
+#ifndef __CENTIPEDE__TEMPLATE_REGISTRY__H__
+#define __CENTIPEDE__TEMPLATE_REGISTRY__H__
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/logger.h"
+#include "centipede/nodes/base_node.h"
+#include "centipede/nodes/scaffold_template.h"
+
+#define TEMPLATE_REGISTRY_POLL_MS 1000
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* TemplateVersion is one parse of a template file, never changed once
+ * published. */
+struct TemplateVersion {
+	TemplateVersion() : version(0) {}
+
+	ScaffoldTemplate parsed;
+	uint64_t version;
+};
+
+/* TemplateSlot is a watched template file and its current version. Slots
+ * belong to the registry and live as long as the process. generation
+ * changes with every version published; current, and the generation it
+ * goes with, are only read and written under _mutex, which a render
+ * takes just once per thread after each reload. */
+class TemplateSlot {
+public:
+	TemplateSlot(const string& path, size_t index)
+		: _path(path), _index(index), _generation(0) {}
+
+	const string& path() const {
+		return _path;
+	}
+
+	/* index: the slot's place in the per-thread caches. */
+	size_t index() const {
+		return _index;
+	}
+
+	uint64_t generation() const {
+		return _generation.load(memory_order_acquire);
+	}
+
+	/* current: the current version, and in *generation its generation. */
+	shared_ptr<const TemplateVersion> current(uint64_t* generation) const {
+		lock_guard<mutex> lock(_mutex);
+		*generation = _generation.load(memory_order_relaxed);
+		return _current;
+	}
+
+	void publish(shared_ptr<const TemplateVersion> version) {
+		lock_guard<mutex> lock(_mutex);
+		_current = move(version);
+		_generation.store(_generation.load(memory_order_relaxed) + 1,
+				  memory_order_release);
+	}
+
+protected:
+	string _path;
+	size_t _index;
+	atomic<uint64_t> _generation;
+	mutable mutex _mutex;
+	shared_ptr<const TemplateVersion> _current;
+};
+
+/* TemplateReader holds the current version of a slot for one render. Each
+ * thread caches the version it last read of every slot, with its
+ * generation, so that while the slot is unchanged a reader costs one
+ * atomic load and no lock or shared count. The cache holds its version
+ * for the readers on its thread; a reload meanwhile, seen by a nested
+ * reader of the same slot, gives that reader its own reference instead of
+ * replacing the one in use. */
+class TemplateReader {
+public:
+	TemplateReader(const TemplateSlot* slot) : _cached(nullptr) {
+		vector<unique_ptr<Cached>>& cache = thread_cache();
+		size_t index = slot->index();
+		if (cache.size() <= index) cache.resize(index + 1);
+		if (!cache[index]) cache[index].reset(new Cached());
+		Cached* cached = cache[index].get();
+		if (cached->generation != slot->generation()) {
+			if (cached->readers) {
+				uint64_t generation;
+				_own = slot->current(&generation);
+				_version = _own.get();
+				return;
+			}
+			cached->version = slot->current(&cached->generation);
+		}
+		++cached->readers;
+		_cached = cached;
+		_version = cached->version.get();
+	}
+
+	~TemplateReader() {
+		if (_cached) --_cached->readers;
+	}
+
+	TemplateReader(const TemplateReader&) = delete;
+	TemplateReader& operator=(const TemplateReader&) = delete;
+
+	const TemplateVersion* operator->() const {
+		return _version;
+	}
+
+protected:
+	/* Cached is one thread's last read of a slot. Generation 0 is never
+	 * published, so a new entry is read on first use. */
+	struct Cached {
+		Cached() : generation(0), readers(0) {}
+
+		shared_ptr<const TemplateVersion> version;
+		uint64_t generation;
+		int readers;
+	};
+
+	static vector<unique_ptr<Cached>>& thread_cache() {
+		thread_local vector<unique_ptr<Cached>> cache;
+		return cache;
+	}
+
+	Cached* _cached;
+	shared_ptr<const TemplateVersion> _own;
+	const TemplateVersion* _version;
+};
+
+/* TemplateRegistry loads ScaffoldNode template files and reloads them when
+ * they change on disk, so that editing a template does not need a restart.
+ * A thread watches the directories of the files with inotify; on a change
+ * it reads and parses the file there, off the request path, and publishes
+ * the new version in the file's slot. A render takes whichever version its
+ * thread has cached, checking only that the slot's generation has not
+ * moved; the first render on a thread after a reload takes the slot's
+ * lock once to pick up the new version. No render takes the registry's
+ * lock or sees a version half built. A replaced version is freed once
+ * every thread that cached it has picked up a newer one or exited, so a
+ * thread that never renders the file again keeps it until then. A file
+ * that cannot be read, or reads empty, keeps its previous version and is
+ * logged.
+ */
+class TemplateRegistry {
+public:
+	static TemplateRegistry* _() {
+		static TemplateRegistry registry;
+		return &registry;
+	}
+
+	~TemplateRegistry() {
+		_alive = false;
+		if (_watcher) _watcher->join();
+		if (_inotify >= 0) close(_inotify);
+	}
+
+	/* watch: the slot for path, loading the file if it is not watched
+	 * already; a watched file is kept current by the watcher. Returns
+	 * nullptr if it was not watched and cannot be read. */
+	TemplateSlot* watch(const string& path) {
+		lock_guard<mutex> lock(_mutex);
+		auto it = _slots.find(path);
+		if (it != _slots.end()) return it->second.get();
+		shared_ptr<const TemplateVersion> version = load(path);
+		if (!version) return nullptr;
+		unique_ptr<TemplateSlot> slot(
+			new TemplateSlot(path, _slots.size()));
+		slot->publish(version);
+		add_watch(path);
+		return (_slots[path] = move(slot)).get();
+	}
+
+protected:
+	TemplateRegistry() : _inotify(-1), _alive(true) {
+		_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_inotify < 0) {
+			Logger::error("(templates) no inotify; templates will "
+				      "not be reloaded");
+		}
+	}
+
+	/* load: reads and parses path into a new version. */
+	static shared_ptr<const TemplateVersion> load(const string& path) {
+		ifstream fin(path);
+		if (!fin.good()) {
+			Logger::error("(templates) cannot read %", path);
+			return nullptr;
+		}
+		stringstream text;
+		text << fin.rdbuf();
+		if (fin.bad() || text.str().empty()) {
+			Logger::error("(templates) % is empty or unreadable; "
+				      "keeping the previous version", path);
+			return nullptr;
+		}
+		Logger::info("(templates) file % has len %", path,
+			     text.str().length());
+		shared_ptr<TemplateVersion> version(new TemplateVersion());
+		version->parsed.parse(text.str());
+		version->version = BaseNode::tick();
+		return version;
+	}
+
+	/* reload: publishes a new version of the slot's file, if it can be
+	 * read. Called with _mutex held. */
+	void reload(TemplateSlot* slot) {
+		shared_ptr<const TemplateVersion> version = load(slot->path());
+		if (version) slot->publish(version);
+	}
+
+	/* add_watch: watches the directory of path, since editors often
+	 * replace a file by renaming another over it. Called with _mutex
+	 * held. */
+	void add_watch(const string& path) {
+		if (_inotify < 0) return;
+		size_t slash = path.rfind('/');
+		string dir = slash == string::npos ? "." :
+			slash == 0 ? "/" : path.substr(0, slash);
+		string name = slash == string::npos ? path :
+			path.substr(slash + 1);
+		int wd = inotify_add_watch(_inotify, dir.c_str(),
+					   IN_CLOSE_WRITE | IN_MOVED_TO |
+					   IN_CREATE);
+		if (wd < 0) {
+			Logger::error("(templates) cannot watch %", dir);
+			return;
+		}
+		_watched[wd][name] = path;
+		if (!_watcher) {
+			_watcher.reset(new thread(&TemplateRegistry::watcher,
+						  this));
+		}
+	}
+
+	void watcher() {
+		alignas(struct inotify_event) char buf[4096];
+		while (_alive) {
+			struct pollfd pfd = {_inotify, POLLIN, 0};
+			int ready = poll(&pfd, 1, TEMPLATE_REGISTRY_POLL_MS);
+			if (ready <= 0) continue;
+			lock_guard<mutex> lock(_mutex);
+			/* a burst of events reloads each file once */
+			map<string, TemplateSlot*> changed;
+			ssize_t r;
+			while ((r = read(_inotify, buf, sizeof(buf))) > 0) {
+				for (char* p = buf; p < buf + r;) {
+					struct inotify_event* event =
+						(struct inotify_event*) p;
+					p += sizeof(*event) + event->len;
+					if (!event->len) continue;
+					auto dir = _watched.find(event->wd);
+					if (dir == _watched.end()) continue;
+					auto file = dir->second.find(event->name);
+					if (file == dir->second.end()) continue;
+					changed[file->second] =
+						_slots[file->second].get();
+				}
+			}
+			for (auto& x : changed) {
+				Logger::info("(templates) reloading %", x.first);
+				reload(x.second);
+			}
+		}
+	}
+
+	/* _mutex orders loads and reloads; renders never take it. */
+	mutex _mutex;
+	map<string, unique_ptr<TemplateSlot>> _slots;
+	/* watch descriptor -> file name in that directory -> path */
+	map<int, map<string, string>> _watched;
+	int _inotify;
+	atomic<bool> _alive;
+	unique_ptr<thread> _watcher;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__TEMPLATE_REGISTRY__H__
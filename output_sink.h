@@ -0,0 +1,89 @@
+#ifndef __CENTIPEDE__OUTPUT_SINK__H__
+#define __CENTIPEDE__OUTPUT_SINK__H__
+
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+using namespace std;
+
+namespace centipede {
+
+/* OutputSink is the append-only target that nodes and backends render
+ * into. It writes straight into a string owned by the caller, without the
+ * locale and formatting machinery of a stringstream, so a caller that
+ * reuses its string across renders stops paying for buffer regrowth once
+ * the capacity settles. Integers are formatted with to_chars. */
+class OutputSink {
+public:
+	OutputSink(string* buffer) : _buffer(buffer) {
+		assert(_buffer);
+	}
+
+	void append(const char* data, size_t length) {
+		_buffer->append(data, length);
+	}
+
+	void append(const string& data) {
+		_buffer->append(data);
+	}
+
+	void put(char c) {
+		_buffer->push_back(c);
+	}
+
+	/* reserve: makes room for at least length more bytes. */
+	void reserve(size_t length) {
+		_buffer->reserve(_buffer->length() + length);
+	}
+
+	OutputSink& operator<<(const string& data) {
+		append(data);
+		return *this;
+	}
+
+	OutputSink& operator<<(const char* data) {
+		append(data, strlen(data));
+		return *this;
+	}
+
+	OutputSink& operator<<(char c) {
+		put(c);
+		return *this;
+	}
+
+	template<typename T>
+	typename enable_if<is_integral<T>::value, OutputSink&>::type
+	operator<<(T value) {
+		char buf[24];
+		auto result = to_chars(buf, buf + sizeof(buf), value);
+		append(buf, result.ptr - buf);
+		return *this;
+	}
+
+	size_t length() const {
+		return _buffer->length();
+	}
+
+	const string& str() const {
+		return *_buffer;
+	}
+
+	/* scratch: a buffer owned by the calling thread that keeps its
+	 * capacity between requests. It is cleared on every call, so it must
+	 * only be taken once per request, at the top of the handler. */
+	static string* scratch() {
+		thread_local string buffer;
+		buffer.clear();
+		return &buffer;
+	}
+
+protected:
+	string* _buffer;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__OUTPUT_SINK__H__
@@ -0,0 +1,105 @@
+#ifndef __CENTIPEDE__RATE_LIMITER__H__
+#define __CENTIPEDE__RATE_LIMITER__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define RATE_LIMITER_BITS 12
+#define RATE_LIMITER_TOKEN_BITS 24
+#define RATE_LIMITER_MILLI 1000
+
+using namespace std;
+
+namespace centipede {
+
+/* RateLimiter is a table of token buckets, one per source address, each
+ * holding up to burst tokens and refilled at rate tokens a second. A
+ * bucket is a single atomic word, the time of its last refill in
+ * milliseconds above the number of thousandths of a token, so taking a
+ * token is one compare-and-swap and never locks. Addresses are hashed to
+ * one of 2^RATE_LIMITER_BITS buckets; the rare addresses sharing a bucket
+ * share its rate. A rate of zero admits everything.
+ */
+class RateLimiter {
+public:
+	RateLimiter() : _rate(0), _capacity(0) {
+		for (auto& x : _buckets) x = 0;
+	}
+
+	void configure(int rate, int burst) {
+		_rate = max(rate, 0);
+		uint64_t most = (1ULL << RATE_LIMITER_TOKEN_BITS) - 1;
+		_capacity = min((uint64_t) max(burst, 1) * RATE_LIMITER_MILLI,
+				most);
+	}
+
+	bool enabled() const {
+		return _rate;
+	}
+
+	/* acquire: takes a token from key's bucket, returning false if it is
+	 * empty. */
+	bool acquire(uint64_t key) {
+		if (!_rate) return true;
+		uint64_t now = now_ms();
+		atomic<uint64_t>& bucket = _buckets[
+			(key * 0x9E3779B97F4A7C15ULL) >> (64 - RATE_LIMITER_BITS)];
+		uint64_t old = bucket.load(memory_order_relaxed);
+		while (true) {
+			uint64_t then = old >> RATE_LIMITER_TOKEN_BITS;
+			uint64_t tokens = old &
+				((1ULL << RATE_LIMITER_TOKEN_BITS) - 1);
+			if (now > then) {
+				tokens = min(tokens + (now - then) * _rate,
+					     _capacity);
+			}
+			if (tokens < RATE_LIMITER_MILLI) return false;
+			tokens -= RATE_LIMITER_MILLI;
+			uint64_t next = (now << RATE_LIMITER_TOKEN_BITS) | tokens;
+			if (bucket.compare_exchange_weak(
+				    old, next, memory_order_relaxed)) {
+				return true;
+			}
+		}
+	}
+
+	/* address_key: the key for a client address, the whole address for
+	 * IPv4 and the /64 network for IPv6. Returns false for other kinds,
+	 * such as the unix socket between workers, which are not limited. */
+	static bool address_key(const struct sockaddr* addr, uint64_t* key) {
+		if (!addr) return false;
+		if (addr->sa_family == AF_INET) {
+			*key = ((const struct sockaddr_in*) addr)->sin_addr.s_addr;
+			return true;
+		}
+		if (addr->sa_family == AF_INET6) {
+			memcpy(key, &((const struct sockaddr_in6*) addr)->sin6_addr,
+			       sizeof(*key));
+			*key ^= 1ULL << 63;
+			return true;
+		}
+		return false;
+	}
+
+protected:
+	/* now_ms: a monotonic clock in milliseconds, never zero, so that an
+	 * untouched bucket starts full. */
+	static uint64_t now_ms() {
+		return chrono::duration_cast<chrono::milliseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count()
+			+ 1;
+	}
+
+	uint64_t _rate;
+	uint64_t _capacity;
+	atomic<uint64_t> _buckets[1 << RATE_LIMITER_BITS];
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__RATE_LIMITER__H__
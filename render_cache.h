@@ -0,0 +1,120 @@
+#ifndef __CENTIPEDE__RENDER_CACHE__H__
+#define __CENTIPEDE__RENDER_CACHE__H__
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "centipede/compression.h"
+#include "centipede/types.h"
+
+#define RENDER_CACHE_SHARDS 16
+
+using namespace std;
+
+namespace centipede {
+
+/* CachedPage is a rendered page together with its compressed forms. */
+struct CachedPage {
+	CachedPage(const string& page) : data(page) {}
+
+	const string data;
+	EncodedResponses encoded;
+};
+
+/* RenderCache keeps the last page rendered for each client, tagged with
+ * the state and the backend's page version it was rendered at. A page is
+ * served again only while both are unchanged. Each of the
+ * RENDER_CACHE_SHARDS shards holds an equal part of the byte budget and
+ * drops its least recently used pages when over it. A budget of zero
+ * disables the cache. */
+class RenderCache {
+public:
+	RenderCache() : _shard_capacity(0) {}
+
+	void set_capacity(size_t bytes) {
+		_shard_capacity = bytes / RENDER_CACHE_SHARDS;
+	}
+
+	bool enabled() const {
+		return _shard_capacity;
+	}
+
+	/* get: returns the cached page or nullptr if there is none for this
+	 * state and version. */
+	shared_ptr<CachedPage> get(const ClientID& cid, int state,
+				   uint64_t version) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul(s._mutex);
+		auto it = s._pages.find(cid);
+		if (it == s._pages.end()) return nullptr;
+		Page& page = it->second;
+		if (page._state != state || page._version != version)
+			return nullptr;
+		s._lru.splice(s._lru.begin(), s._lru, page._lru);
+		return page._data;
+	}
+
+	shared_ptr<CachedPage> put(const ClientID& cid, int state,
+				   uint64_t version, const string& data) {
+		if (data.length() > _shard_capacity) return nullptr;
+		shared_ptr<CachedPage> copy(new CachedPage(data));
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul(s._mutex);
+		drop(&s, cid);
+		s._lru.push_front(cid);
+		Page& page = s._pages[cid];
+		page._state = state;
+		page._version = version;
+		page._data = copy;
+		page._lru = s._lru.begin();
+		s._bytes += data.length();
+		while (s._bytes > _shard_capacity) drop(&s, s._lru.back());
+		return copy;
+	}
+
+	void erase(const ClientID& cid) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul(s._mutex);
+		drop(&s, cid);
+	}
+
+protected:
+	struct Page {
+		int _state;
+		uint64_t _version;
+		shared_ptr<CachedPage> _data;
+		list<ClientID>::iterator _lru;
+	};
+
+	struct Shard {
+		Shard() : _bytes(0) {}
+
+		mutex _mutex;
+		unordered_map<ClientID, Page> _pages;
+		list<ClientID> _lru;
+		size_t _bytes;
+	};
+
+	Shard& shard(const ClientID& cid) {
+		return _shards[cid % RENDER_CACHE_SHARDS];
+	}
+
+	/* drop: must hold the shard's mutex */
+	void drop(Shard* s, ClientID cid) {
+		auto it = s->_pages.find(cid);
+		if (it == s->_pages.end()) return;
+		s->_bytes -= it->second._data->data.length();
+		s->_lru.erase(it->second._lru);
+		s->_pages.erase(it);
+	}
+
+	size_t _shard_capacity;
+	Shard _shards[RENDER_CACHE_SHARDS];
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__RENDER_CACHE__H__
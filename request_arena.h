@@ -0,0 +1,48 @@
+#ifndef __CENTIPEDE__REQUEST_ARENA__H__
+#define __CENTIPEDE__REQUEST_ARENA__H__
+
+#include <memory_resource>
+
+#define REQUEST_ARENA_BYTES (16 << 10)
+
+using namespace std;
+
+namespace centipede {
+
+/* RequestArena is a monotonic arena for the temporaries of one request,
+ * such as the views of its parameters and query arguments, so that they
+ * cost a pointer bump instead of a malloc and free each. There is one
+ * arena per thread, starting in a fixed buffer and spilling to the heap
+ * only for unusually large requests. It is reset at the top of each
+ * request callback; nothing allocated from it may outlive the callback.
+ */
+class RequestArena {
+public:
+	/* get: the calling thread's arena. */
+	static pmr::memory_resource* get() {
+		return &arena()._resource;
+	}
+
+	/* reset: frees everything allocated from the calling thread's
+	 * arena, returning it to its buffer. */
+	static void reset() {
+		arena()._resource.release();
+	}
+
+protected:
+	RequestArena()
+		: _resource(_buffer, sizeof(_buffer),
+			    pmr::new_delete_resource()) {}
+
+	static RequestArena& arena() {
+		thread_local RequestArena arena;
+		return arena;
+	}
+
+	alignas(max_align_t) char _buffer[REQUEST_ARENA_BYTES];
+	pmr::monotonic_buffer_resource _resource;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__REQUEST_ARENA__H__
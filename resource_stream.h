@@ -0,0 +1,212 @@
+#ifndef __CENTIPEDE__RESOURCE_STREAM__H__
+#define __CENTIPEDE__RESOURCE_STREAM__H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <microhttpd.h>
+#include <string>
+#include <sys/stat.h>
+
+#include "ib/logger.h"
+#include "centipede/backend/resource_body.h"
+
+#define RESOURCE_STREAM_BLOCK (64 << 10)
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+enum RangeRequest {
+	RANGE_NONE,		/* no Range header, or one not honored */
+	RANGE_PARTIAL,		/* a single satisfiable byte range */
+	RANGE_UNSATISFIABLE,
+};
+
+/* ResourceStream queues the reply for a ResourceBody without copying it
+ * into memory: a file descriptor through MHD's fd responses, which use
+ * sendfile, and a generator through a content reader callback. A single
+ * byte range in a Range header is answered with 206 Partial Content; a
+ * list of ranges is answered with the whole resource, as RFC 9110
+ * allows, and so is a range whose If-Range no longer holds. */
+class ResourceStream {
+public:
+	/* send: queues the reply, giving its status and the bytes it sends,
+	 * when known. */
+	static int send(struct MHD_Connection* connection, ResourceBody* body,
+			unsigned int* status, uint64_t* sent) {
+		*status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		*sent = 0;
+		if (body->fd >= 0 && body->size == RESOURCE_SIZE_UNKNOWN) {
+			struct stat sb;
+			if (fstat(body->fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+			    (uint64_t) sb.st_size >= body->offset) {
+				body->size = sb.st_size - body->offset;
+			}
+		}
+		if (body->fd >= 0 && body->size == RESOURCE_SIZE_UNKNOWN) {
+			Logger::error("(resource) cannot size the resource fd");
+			return MHD_NO;
+		}
+		bool ranges = body->ranges && body->size != RESOURCE_SIZE_UNKNOWN;
+		uint64_t start = 0;
+		uint64_t length = body->size;
+		RangeRequest range = RANGE_NONE;
+		if (ranges && if_range(connection, *body)) {
+			range = parse_range(MHD_lookup_connection_value(
+						    connection, MHD_HEADER_KIND,
+						    MHD_HTTP_HEADER_RANGE),
+					    body->size, &start, &length);
+		}
+		if (range == RANGE_UNSATISFIABLE) {
+			struct MHD_Response* response =
+				MHD_create_response_from_buffer(
+					0, (void *) "", MHD_RESPMEM_PERSISTENT);
+			string unsatisfied = "bytes */" + to_string(body->size);
+			*status = MHD_HTTP_RANGE_NOT_SATISFIABLE;
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_CONTENT_RANGE,
+						unsatisfied.c_str());
+			int ret = MHD_queue_response(
+				connection, MHD_HTTP_RANGE_NOT_SATISFIABLE,
+				response);
+			MHD_destroy_response(response);
+			return ret;
+		}
+
+		struct MHD_Response* response;
+		if (body->fd >= 0) {
+			response = MHD_create_response_from_fd_at_offset64(
+				length, body->fd, body->offset + start);
+			if (response) body->release();
+		} else if (body->generate) {
+			response = MHD_create_response_from_callback(
+				length == RESOURCE_SIZE_UNKNOWN ?
+					MHD_SIZE_UNKNOWN : length,
+				RESOURCE_STREAM_BLOCK, &read_generator,
+				new Generator{move(body->generate), start},
+				&free_generator);
+		} else {
+			Logger::error("(resource) body has neither fd nor "
+				      "generator");
+			return MHD_NO;
+		}
+		if (!response) return MHD_NO;
+		if (!body->content_type.empty()) {
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_CONTENT_TYPE,
+						body->content_type.c_str());
+		}
+		if (ranges) {
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_ACCEPT_RANGES,
+						"bytes");
+		}
+		if (!body->etag.empty()) {
+			MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG,
+						body->etag.c_str());
+		}
+		if (!body->last_modified.empty()) {
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_LAST_MODIFIED,
+						body->last_modified.c_str());
+		}
+		*status = MHD_HTTP_OK;
+		if (range == RANGE_PARTIAL) {
+			string content_range = "bytes " + to_string(start) +
+				"-" + to_string(start + length - 1) + "/" +
+				to_string(body->size);
+			MHD_add_response_header(response,
+						MHD_HTTP_HEADER_CONTENT_RANGE,
+						content_range.c_str());
+			*status = MHD_HTTP_PARTIAL_CONTENT;
+		}
+		int ret = MHD_queue_response(connection, *status, response);
+		MHD_destroy_response(response);
+		if (length != RESOURCE_SIZE_UNKNOWN) *sent = length;
+		return ret;
+	}
+
+	/* if_range: whether a Range may be honored under the request's
+	 * If-Range, if any: an entity tag must be the body's strong etag and
+	 * a date its last_modified, exactly. */
+	static bool if_range(struct MHD_Connection* connection,
+			     const ResourceBody& body) {
+		const char* header = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_RANGE);
+		if (!header) return true;
+		if (*header == '"' || strncmp(header, "W/", 2) == 0) {
+			return *header == '"' && body.etag == header;
+		}
+		return !body.last_modified.empty() &&
+			body.last_modified == header;
+	}
+
+	/* parse_range: reads a Range header of one byte range, such as
+	 * bytes=0-499, bytes=500- or bytes=-500, against a resource of size
+	 * bytes. */
+	static RangeRequest parse_range(const char* header, uint64_t size,
+					uint64_t* start, uint64_t* length) {
+		if (!header || strncmp(header, "bytes=", 6)) return RANGE_NONE;
+		const char* spec = header + 6;
+		if (strchr(spec, ',')) return RANGE_NONE;
+		while (*spec == ' ') ++spec;
+		char* end;
+		if (*spec == '-') {
+			uint64_t suffix = strtoull(spec + 1, &end, 10);
+			if (end == spec + 1 || !trailing(end)) return RANGE_NONE;
+			if (!suffix || !size) return RANGE_UNSATISFIABLE;
+			*length = min(suffix, size);
+			*start = size - *length;
+			return RANGE_PARTIAL;
+		}
+		if (*spec < '0' || *spec > '9') return RANGE_NONE;
+		uint64_t first = strtoull(spec, &end, 10);
+		if (*end != '-') return RANGE_NONE;
+		const char* rest = end + 1;
+		uint64_t last = size ? size - 1 : 0;
+		if (*rest >= '0' && *rest <= '9') {
+			last = strtoull(rest, &end, 10);
+			if (last < first) return RANGE_NONE;
+			last = min(last, size ? size - 1 : 0);
+			rest = end;
+		}
+		if (!trailing(rest)) return RANGE_NONE;
+		if (first >= size) return RANGE_UNSATISFIABLE;
+		*start = first;
+		*length = last - first + 1;
+		return RANGE_PARTIAL;
+	}
+
+protected:
+	/* Generator is a body's generator and where the reply starts in it. */
+	struct Generator {
+		function<ssize_t(uint64_t, char*, size_t)> generate;
+		uint64_t start;
+	};
+
+	static ssize_t read_generator(void* cls, uint64_t position, char* buf,
+				      size_t max) {
+		Generator* generator = (Generator*) cls;
+		ssize_t r = generator->generate(generator->start + position,
+						buf, max);
+		if (r == 0) return MHD_CONTENT_READER_END_OF_STREAM;
+		if (r < 0) return MHD_CONTENT_READER_END_WITH_ERROR;
+		return r;
+	}
+
+	static void free_generator(void* cls) {
+		delete (Generator*) cls;
+	}
+
+	static bool trailing(const char* p) {
+		while (*p == ' ') ++p;
+		return !*p;
+	}
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__RESOURCE_STREAM__H__
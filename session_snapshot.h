@@ -0,0 +1,244 @@
+#ifndef __CENTIPEDE__SESSION_SNAPSHOT__H__
+#define __CENTIPEDE__SESSION_SNAPSHOT__H__
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "ib/logger.h"
+#include "centipede/types.h"
+
+#define SESSION_SNAPSHOT_MAGIC 0x32504e5343ULL
+#define SESSION_SNAPSHOT_BLOB_BYTES 232
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* SnapshotRecord is one session as kept in the snapshot file. A record
+ * with cid CLIENT_ALL is free. last_active is wall-clock seconds, so that
+ * it survives the restart of sensible_time::runtime(), and 64 bits wide,
+ * so that it survives 2038. */
+struct SnapshotRecord {
+	uint64_t cid;
+	int64_t last_active;
+	int32_t state;
+	uint32_t blob_length;
+	char blob[SESSION_SNAPSHOT_BLOB_BYTES];
+};
+
+static_assert(sizeof(SnapshotRecord) == 256, "SnapshotRecord size");
+
+struct SnapshotHeader {
+	uint64_t magic;
+	uint32_t shards;
+	uint32_t slots;
+	char reserved[48];
+};
+
+/* SessionSnapshot mirrors the sessions of a SessionStore into a shared
+ * memory mapping of a file, one fixed-size record per session, so that
+ * every change is a store into the page cache and the file is current
+ * whenever the process stops, however it stops. The records are divided
+ * into one region per store shard, and the methods taking a shard must be
+ * called with that shard's lock held; nothing else is synchronized.
+ *
+ * Sessions beyond the capacity of their region are simply not saved.
+ */
+class SessionSnapshot {
+public:
+	SessionSnapshot() : _header(nullptr), _records(nullptr), _bytes(0),
+		_per_shard(0), _epoch(0) {}
+
+	~SessionSnapshot() {
+		if (_header) munmap(_header, _bytes);
+	}
+
+	bool enabled() const {
+		return _records;
+	}
+
+	/* open: reads the sessions saved in path into restored, then
+	 * replaces the file with an empty one of slots records over shards
+	 * regions. now is the current sensible_time::runtime(). */
+	bool open(const string& path, size_t shards, size_t slots, int now,
+		  vector<SnapshotRecord>* restored) {
+		_epoch = time(nullptr) - now;
+		load(path, restored);
+
+		_per_shard = (slots + shards - 1) / shards;
+		_bytes = sizeof(SnapshotHeader) +
+			shards * _per_shard * sizeof(SnapshotRecord);
+		string temp = path + ".tmp";
+		int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0) {
+			Logger::error("(snapshot) cannot create %", temp);
+			return false;
+		}
+		void* data = MAP_FAILED;
+		if (ftruncate(fd, _bytes) == 0) {
+			data = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (data == MAP_FAILED) {
+			Logger::error("(snapshot) cannot map %", temp);
+			unlink(temp.c_str());
+			return false;
+		}
+		_header = (SnapshotHeader*) data;
+		_header->magic = SESSION_SNAPSHOT_MAGIC;
+		_header->shards = shards;
+		_header->slots = _per_shard * shards;
+		_records = (SnapshotRecord*) (_header + 1);
+		if (rename(temp.c_str(), path.c_str())) {
+			Logger::error("(snapshot) cannot replace %", path);
+			munmap(_header, _bytes);
+			_header = nullptr;
+			_records = nullptr;
+			return false;
+		}
+		_regions.clear();
+		_regions.resize(shards);
+		for (size_t i = 0; i < shards; ++i) {
+			Region& r = _regions[i];
+			for (size_t j = _per_shard; j > 0; --j) {
+				r._free.push_back(i * _per_shard + j - 1);
+			}
+		}
+		return true;
+	}
+
+	/* put: saves a new session. */
+	void put(size_t shard, const ClientID& cid, int state, int now) {
+		Region& r = _regions[shard];
+		if (r._free.empty()) {
+			if (!r._full) {
+				Logger::error("(snapshot) shard % is full; "
+					      "new sessions are not saved",
+					      shard);
+				r._full = true;
+			}
+			return;
+		}
+		uint32_t slot = r._free.back();
+		r._free.pop_back();
+		r._index[cid] = slot;
+		SnapshotRecord& record = _records[slot];
+		record.state = state;
+		record.last_active = now + _epoch;
+		record.blob_length = 0;
+		record.cid = cid;
+	}
+
+	void touch(size_t shard, const ClientID& cid, int now) {
+		SnapshotRecord* record = find(shard, cid);
+		if (record && record->last_active != now + _epoch)
+			record->last_active = now + _epoch;
+	}
+
+	void set_state(size_t shard, const ClientID& cid, int state) {
+		SnapshotRecord* record = find(shard, cid);
+		if (record) record->state = state;
+	}
+
+	/* set_blob: returns false if the blob is too large to save. */
+	bool set_blob(size_t shard, const ClientID& cid, string_view blob) {
+		if (blob.length() > SESSION_SNAPSHOT_BLOB_BYTES) return false;
+		SnapshotRecord* record = find(shard, cid);
+		if (!record) return true;
+		record->blob_length = 0;
+		memcpy(record->blob, blob.data(), blob.length());
+		record->blob_length = blob.length();
+		return true;
+	}
+
+	void erase(size_t shard, const ClientID& cid) {
+		Region& r = _regions[shard];
+		auto it = r._index.find(cid);
+		if (it == r._index.end()) return;
+		_records[it->second].cid = CLIENT_ALL;
+		r._free.push_back(it->second);
+		r._index.erase(it);
+		r._full = false;
+	}
+
+	/* runtime: converts a saved last_active back to runtime seconds. */
+	int runtime(const SnapshotRecord& record) const {
+		return (int) (record.last_active - _epoch);
+	}
+
+	/* flush: asks the kernel to write the file out; wait blocks until it
+	 * has. Only needed to survive the machine, not the process. */
+	void flush(bool wait) {
+		if (_header) msync(_header, _bytes, wait ? MS_SYNC : MS_ASYNC);
+	}
+
+protected:
+	struct Region {
+		Region() : _full(false) {}
+
+		unordered_map<ClientID, uint32_t> _index;
+		vector<uint32_t> _free;
+		bool _full;
+	};
+
+	SnapshotRecord* find(size_t shard, const ClientID& cid) {
+		Region& r = _regions[shard];
+		auto it = r._index.find(cid);
+		if (it == r._index.end()) return nullptr;
+		return &_records[it->second];
+	}
+
+	static void load(const string& path, vector<SnapshotRecord>* output) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat sb;
+		void* data = MAP_FAILED;
+		if (fstat(fd, &sb) == 0 &&
+		    (size_t) sb.st_size >= sizeof(SnapshotHeader)) {
+			data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE,
+				    fd, 0);
+		}
+		close(fd);
+		if (data == MAP_FAILED) return;
+		const SnapshotHeader* header = (const SnapshotHeader*) data;
+		size_t records = (sb.st_size - sizeof(SnapshotHeader)) /
+			sizeof(SnapshotRecord);
+		if (header->magic != SESSION_SNAPSHOT_MAGIC ||
+		    header->slots > records) {
+			Logger::error("(snapshot) ignoring invalid %", path);
+			munmap(data, sb.st_size);
+			return;
+		}
+		const SnapshotRecord* record =
+			(const SnapshotRecord*) (header + 1);
+		for (size_t i = 0; i < header->slots; ++i) {
+			if (record[i].cid == CLIENT_ALL) continue;
+			if (record[i].blob_length > SESSION_SNAPSHOT_BLOB_BYTES)
+				continue;
+			output->push_back(record[i]);
+		}
+		munmap(data, sb.st_size);
+	}
+
+	SnapshotHeader* _header;
+	SnapshotRecord* _records;
+	size_t _bytes;
+	size_t _per_shard;
+	int64_t _epoch;
+	vector<Region> _regions;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__SESSION_SNAPSHOT__H__
@@ -0,0 +1,466 @@
+#ifndef __CENTIPEDE__SESSION_STORE__H__
+#define __CENTIPEDE__SESSION_STORE__H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "centipede/session_snapshot.h"
+#include "centipede/session_table.h"
+#include "centipede/timer_wheel.h"
+#include "centipede/types.h"
+
+#define SESSION_SHARDS 64
+
+using namespace std;
+
+namespace centipede {
+
+/* SessionStore holds the per-client session state for the WebServer. The
+ * ClientIDs are spread over SESSION_SHARDS independently locked shards, so
+ * that requests for different clients only contend when they land in the
+ * same shard. Each method takes exactly one shard lock and never calls
+ * out of the store while holding it.
+ *
+ * Idle sessions are found with a TimerWheel per shard. A session is filed
+ * once, at the tick it would expire if never touched again, so touching it
+ * only stores the time. When its tick comes round it is either expired or
+ * filed again at its new deadline.
+ *
+ * If a snapshot is opened, every change is also mirrored into its record
+ * in the SessionSnapshot, under the same shard lock.
+ *
+ * Requests that change a session, sets and commands, are serialized per
+ * session with begin_write and end_write, so that each reads the state the
+ * previous one left. Those waiting for a session are queued on it in
+ * order, and end_write hands the mark to the first. A SessionWriter waits
+ * for its turn on its thread; a SessionTurn is called back when the mark
+ * is handed to it, so a server thread need not wait.
+ *
+ * Acquisitions of the shard locks are counted per shard, under the lock
+ * taken, so counting shares no cache line between shards; the counts are
+ * summed when read. Contended acquisitions, and the time spent waiting
+ * for them, are counted store-wide, which only the contended path pays
+ * for; an uncontended lock costs no clock reads.
+ */
+class SessionStore {
+public:
+	SessionStore()
+		: _life_period(0), _count(0), _shed_shard(0),
+		  _contended(0), _wait_us(0) {}
+
+	/* set_life_period: the number of seconds a session may stay idle. It
+	 * applies to sessions created afterwards and to every refiling. */
+	void set_life_period(int life_period) {
+		_life_period = life_period;
+	}
+
+	/* create: adds a new session in state 0. Returns false if the cid is
+	 * already in use or is CLIENT_ALL. */
+	bool create(const ClientID& cid, int now) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		Session* session = s._table.insert(cid);
+		if (!session) return false;
+		++_count;
+		session->last_active = now;
+		s._wheel.schedule(cid, now + _life_period + 1);
+		if (_snapshot.enabled()) _snapshot.put(index(s), cid, 0, now);
+		return true;
+	}
+
+	/* open_snapshot: brings back the sessions saved in path, appending
+	 * them to restored, and from then on saves every session there, up
+	 * to slots of them. Sessions that went idle past the life period
+	 * while the server was down are dropped. Must be called after
+	 * set_life_period and before the store is used. */
+	bool open_snapshot(const string& path, size_t slots, int now,
+			   vector<SnapshotRecord>* restored) {
+		vector<SnapshotRecord> saved;
+		if (!_snapshot.open(path, SESSION_SHARDS, slots, now, &saved))
+			return false;
+		for (auto& x : saved) {
+			if (now - _snapshot.runtime(x) > _life_period) continue;
+			Shard& s = shard(x.cid);
+			unique_lock<mutex> ul = lock(s);
+			Session* session = s._table.insert(x.cid);
+			if (!session) continue;
+			++_count;
+			session->state = x.state;
+			session->last_active = _snapshot.runtime(x);
+			s._wheel.schedule(x.cid, session->last_active
+					  + _life_period + 1);
+			_snapshot.put(index(s), x.cid, x.state,
+				      session->last_active);
+			_snapshot.set_blob(index(s), x.cid,
+					   string_view(x.blob, x.blob_length));
+			restored->push_back(x);
+		}
+		return true;
+	}
+
+	bool snapshot_enabled() const {
+		return _snapshot.enabled();
+	}
+
+	/* set_blob: saves the backend's blob for the session in the
+	 * snapshot. Returns false if it is too large. */
+	bool set_blob(const ClientID& cid, string_view blob) {
+		if (!_snapshot.enabled()) return true;
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		if (!s._table.find(cid)) return true;
+		return _snapshot.set_blob(index(s), cid, blob);
+	}
+
+	void flush_snapshot(bool wait) {
+		_snapshot.flush(wait);
+	}
+
+	bool exists(const ClientID& cid) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		return s._table.find(cid);
+	}
+
+	/* Waiter is queued for a session's write mark. end_write calls it,
+	 * without the shard lock, to hand the mark over; it returns false if
+	 * its request has gone, and the mark passes to the next in line. */
+	typedef function<bool()> Waiter;
+
+	/* begin_write: waits until no other request is changing the
+	 * session, then marks it as being changed until end_write, which may
+	 * be called from another thread. The state should be read after it
+	 * returns. */
+	void begin_write(const ClientID& cid) {
+		Shard& s = shard(cid);
+		bool handed = false;
+		Waiter waiter = [&s, &handed]() {
+			{
+				lock_guard<mutex> lg(s._mutex);
+				handed = true;
+			}
+			s._written.notify_all();
+			return true;
+		};
+		if (try_begin_write(cid, waiter)) return;
+		unique_lock<mutex> ul = lock(s);
+		s._written.wait(ul, [&handed]() { return handed; });
+	}
+
+	/* try_begin_write: marks the session as being changed and returns
+	 * true if no other request is changing it. Otherwise queues waiter,
+	 * which is called once the mark is handed to it, and returns
+	 * false. */
+	bool try_begin_write(const ClientID& cid, Waiter waiter) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		auto it = s._writers.find(cid);
+		if (it == s._writers.end()) {
+			s._writers.emplace(cid, deque<Waiter>());
+			return true;
+		}
+		it->second.push_back(move(waiter));
+		return false;
+	}
+
+	/* end_write: hands the mark to the first request queued for it, or
+	 * clears it. */
+	void end_write(const ClientID& cid) {
+		Shard& s = shard(cid);
+		while (true) {
+			Waiter next;
+			{
+				unique_lock<mutex> ul = lock(s);
+				auto it = s._writers.find(cid);
+				if (it == s._writers.end()) return;
+				if (it->second.empty()) {
+					s._writers.erase(it);
+					return;
+				}
+				next = move(it->second.front());
+				it->second.pop_front();
+			}
+			if (next()) return;
+		}
+	}
+
+	/* touch: marks the client as active. Returns false if unknown. If
+	 * state is non-null it receives the client's current state. */
+	bool touch(const ClientID& cid, int now, int* state = nullptr) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		Session* session = s._table.find(cid);
+		if (!session) return false;
+		session->last_active = now;
+		if (state) *state = session->state;
+		if (_snapshot.enabled()) _snapshot.touch(index(s), cid, now);
+		return true;
+	}
+
+	int state(const ClientID& cid) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		Session* session = s._table.find(cid);
+		if (!session) return 0;
+		return session->state;
+	}
+
+	/* set_state: updates the state of a known client. A client evicted
+	 * while its command ran is not resurrected. */
+	void set_state(const ClientID& cid, int state) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		Session* session = s._table.find(cid);
+		if (!session) return;
+		session->state = state;
+		if (_snapshot.enabled())
+			_snapshot.set_state(index(s), cid, state);
+	}
+
+	bool erase(const ClientID& cid) {
+		Shard& s = shard(cid);
+		unique_lock<mutex> ul = lock(s);
+		if (_snapshot.enabled()) _snapshot.erase(index(s), cid);
+		if (!s._table.erase(cid)) return false;
+		--_count;
+		return true;
+	}
+
+	/* expire: removes every session idle for longer than the life
+	 * period and appends its cid to output. The work done is proportional
+	 * to the sessions whose deadline has come round, not to the number
+	 * of sessions. */
+	void expire(int now, vector<ClientID>* output) {
+		for (auto& s : _shards) {
+			unique_lock<mutex> ul = lock(s);
+			s._wheel.advance(now, [&](const ClientID& cid) {
+				Session* session = s._table.find(cid);
+				if (!session) return;
+				int deadline = session->last_active
+					+ _life_period;
+				if (now - deadline > 0) {
+					s._table.erase(cid);
+					--_count;
+					if (_snapshot.enabled())
+						_snapshot.erase(index(s), cid);
+					output->push_back(cid);
+				} else {
+					s._wheel.schedule(cid, deadline + 1);
+				}
+			});
+		}
+	}
+
+	/* shed: removes up to count of the least recently active sessions,
+	 * appending their cids to output. Each shard's wheel files its
+	 * sessions by deadline, so a shard gives up its oldest without a
+	 * scan. The count is spread over all the shards, starting from a
+	 * different one each time, and each takes its share from its own
+	 * oldest. That is only an approximation of the global LRU order:
+	 * shards hold random cids, so their oldest are old overall, but a
+	 * session shed from one shard may be younger than some left in
+	 * another. */
+	void shed(size_t count, vector<ClientID>* output) {
+		for (size_t i = 0; count && i < SESSION_SHARDS; ++i) {
+			size_t share = (count + SESSION_SHARDS - i - 1) /
+				(SESSION_SHARDS - i);
+			Shard& s = _shards[_shed_shard++ % SESSION_SHARDS];
+			unique_lock<mutex> ul = lock(s);
+			s._wheel.earliest([&](const ClientID& cid, int tick) {
+				Session* session = s._table.find(cid);
+				if (!session) return false;
+				int due = session->last_active + _life_period + 1;
+				if (due > tick) {
+					/* touched since it was filed */
+					s._wheel.schedule(cid, due);
+					return false;
+				}
+				s._table.erase(cid);
+				--_count;
+				--count;
+				if (_snapshot.enabled())
+					_snapshot.erase(index(s), cid);
+				output->push_back(cid);
+				return !--share;
+			});
+		}
+	}
+
+	size_t size() const {
+		return _count.load(memory_order_relaxed);
+	}
+
+	uint64_t lock_acquisitions() const {
+		uint64_t retval = 0;
+		for (auto& x : _shards)
+			retval += x._acquisitions.load(memory_order_relaxed);
+		return retval;
+	}
+
+	uint64_t lock_contended() const {
+		return _contended.load(memory_order_relaxed);
+	}
+
+	uint64_t lock_wait_us() const {
+		return _wait_us.load(memory_order_relaxed);
+	}
+
+protected:
+	struct Shard {
+		mutex _mutex;
+		SessionTable _table;
+		TimerWheel _wheel;
+		/* sessions between begin_write and end_write, each with the
+		 * requests queued for its mark */
+		map<ClientID, deque<Waiter>> _writers;
+		/* signalled when the mark is handed to a begin_write */
+		condition_variable _written;
+		/* written under _mutex, read at scrape time */
+		atomic<uint64_t> _acquisitions{0};
+	};
+
+	Shard& shard(const ClientID& cid) {
+		return _shards[cid % SESSION_SHARDS];
+	}
+
+	size_t index(const Shard& s) const {
+		return &s - _shards;
+	}
+
+	unique_lock<mutex> lock(Shard& s) {
+		unique_lock<mutex> ul(s._mutex, try_to_lock);
+		if (ul.owns_lock()) {
+			counted(s);
+			return ul;
+		}
+		auto start = chrono::steady_clock::now();
+		ul.lock();
+		counted(s);
+		_contended.fetch_add(1, memory_order_relaxed);
+		_wait_us.fetch_add(
+			chrono::duration_cast<chrono::microseconds>(
+				chrono::steady_clock::now() - start).count(),
+			memory_order_relaxed);
+		return ul;
+	}
+
+	/* counted: counts an acquisition of s, whose lock is held, so a
+	 * plain load and store do. */
+	static void counted(Shard& s) {
+		s._acquisitions.store(
+			s._acquisitions.load(memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	}
+
+	int _life_period;
+	Shard _shards[SESSION_SHARDS];
+	atomic<size_t> _count;
+	atomic<size_t> _shed_shard;
+	atomic<uint64_t> _contended;
+	atomic<uint64_t> _wait_us;
+	SessionSnapshot _snapshot;
+};
+
+/* SessionWriter holds a session's write mark from its construction to
+ * release() or its destruction, whichever comes first. A null store makes
+ * it do nothing. */
+class SessionWriter {
+public:
+	SessionWriter(SessionStore* store, const ClientID& cid)
+		: _store(store), _cid(cid) {
+		if (_store) _store->begin_write(_cid);
+	}
+
+	~SessionWriter() {
+		release();
+	}
+
+	SessionWriter(const SessionWriter&) = delete;
+	SessionWriter& operator=(const SessionWriter&) = delete;
+
+	void release() {
+		if (_store) _store->end_write(_cid);
+		_store = nullptr;
+	}
+
+protected:
+	SessionStore* _store;
+	ClientID _cid;
+};
+
+/* SessionTurn takes a session's write mark without waiting for it: if
+ * another request is changing the session, the turn is queued behind it
+ * and ready is called, on the thread that ends that write, once the mark
+ * is handed over. The mark is then held until release() or the turn's
+ * destruction; a turn destroyed while still queued is skipped. */
+class SessionTurn {
+public:
+	static shared_ptr<SessionTurn> take(SessionStore* store,
+					    const ClientID& cid,
+					    function<void()> ready) {
+		shared_ptr<SessionTurn> retval(new SessionTurn(store, cid));
+		weak_ptr<SessionTurn> weak = retval;
+		retval->_ready = ready;
+		bool held = store->try_begin_write(cid, [weak]() {
+			shared_ptr<SessionTurn> turn = weak.lock();
+			if (!turn) return false;
+			turn->handed();
+			return true;
+		});
+		/* not queued, so not shared yet */
+		if (held) retval->_held = true;
+		return retval;
+	}
+
+	~SessionTurn() {
+		release();
+	}
+
+	SessionTurn(const SessionTurn&) = delete;
+	SessionTurn& operator=(const SessionTurn&) = delete;
+
+	bool held() {
+		unique_lock<mutex> ul(_mutex);
+		return _held;
+	}
+
+	void release() {
+		{
+			unique_lock<mutex> ul(_mutex);
+			if (!_held) return;
+			_held = false;
+		}
+		_store->end_write(_cid);
+	}
+
+protected:
+	SessionTurn(SessionStore* store, const ClientID& cid)
+		: _store(store), _cid(cid), _held(false) {}
+
+	void handed() {
+		{
+			unique_lock<mutex> ul(_mutex);
+			_held = true;
+		}
+		_ready();
+	}
+
+	SessionStore* _store;
+	ClientID _cid;
+	mutex _mutex;
+	bool _held;
+	function<void()> _ready;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__SESSION_STORE__H__
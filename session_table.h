@@ -0,0 +1,123 @@
+#ifndef __CENTIPEDE__SESSION_TABLE__H__
+#define __CENTIPEDE__SESSION_TABLE__H__
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "centipede/types.h"
+
+#define SESSION_TABLE_MIN_BITS 4
+
+using namespace std;
+
+namespace centipede {
+
+/* Session is the record kept for each client. Rarely used fields are held
+ * out of line so that the record stays small and two fit a cache line. */
+struct Session {
+	Session() : cid(CLIENT_ALL), state(0), last_active(0) {}
+
+	ClientID cid;
+	int state;
+	int last_active;
+
+	unique_ptr<set<string>> possible_commands;
+	unique_ptr<set<string>> possible_resources;
+};
+
+/* SessionTable is an open-addressing hash table of Session records with
+ * linear probing. ClientIDs are uniformly random so they are hashed with a
+ * single multiply, which also keeps the table usable when the low bits of
+ * its keys are shared, as they are within a SessionStore shard. CLIENT_ALL
+ * is never a client and marks an empty slot. Erasing shifts the following
+ * records back, so there are no tombstones and Session pointers are only
+ * valid until the next insert or erase. The table is not synchronized.
+ */
+class SessionTable {
+public:
+	SessionTable() : _size(0), _bits(0) {}
+
+	Session* find(const ClientID& cid) {
+		if (_slots.empty() || cid == CLIENT_ALL) return nullptr;
+		size_t mask = _slots.size() - 1;
+		for (size_t i = home(cid); ; i = (i + 1) & mask) {
+			if (_slots[i].cid == cid) return &_slots[i];
+			if (_slots[i].cid == CLIENT_ALL) return nullptr;
+		}
+	}
+
+	/* insert: returns the new record, or nullptr if the cid is already
+	 * present or is CLIENT_ALL. */
+	Session* insert(const ClientID& cid) {
+		if (cid == CLIENT_ALL) return nullptr;
+		if ((_size + 1) * 2 > _slots.size()) grow();
+		size_t mask = _slots.size() - 1;
+		size_t i = home(cid);
+		for (; _slots[i].cid != CLIENT_ALL; i = (i + 1) & mask) {
+			if (_slots[i].cid == cid) return nullptr;
+		}
+		_slots[i].cid = cid;
+		++_size;
+		return &_slots[i];
+	}
+
+	bool erase(const ClientID& cid) {
+		Session* session = find(cid);
+		if (!session) return false;
+		size_t mask = _slots.size() - 1;
+		size_t i = session - _slots.data();
+		size_t j = i;
+		while (true) {
+			j = (j + 1) & mask;
+			if (_slots[j].cid == CLIENT_ALL) break;
+			size_t k = home(_slots[j].cid);
+			/* move j back into the hole at i unless its home lies
+			 * cyclically in (i, j] */
+			if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			_slots[i] = std::move(_slots[j]);
+			i = j;
+		}
+		_slots[i] = Session();
+		--_size;
+		return true;
+	}
+
+	template<typename F>
+	void for_each(F f) {
+		for (auto& x : _slots) {
+			if (x.cid != CLIENT_ALL) f(x);
+		}
+	}
+
+	size_t size() const {
+		return _size;
+	}
+
+protected:
+	size_t home(const ClientID& cid) const {
+		return (cid * 0x9E3779B97F4A7C15ULL) >> (64 - _bits);
+	}
+
+	void grow() {
+		vector<Session> old;
+		old.swap(_slots);
+		_bits = _bits ? _bits + 1 : SESSION_TABLE_MIN_BITS;
+		_slots.resize(1ULL << _bits);
+		_size = 0;
+		for (auto& x : old) {
+			if (x.cid == CLIENT_ALL) continue;
+			*insert(x.cid) = std::move(x);
+		}
+	}
+
+	vector<Session> _slots;
+	size_t _size;
+	int _bits;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__SESSION_TABLE__H__
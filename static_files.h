@@ -0,0 +1,331 @@
+#ifndef __CENTIPEDE__STATIC_FILES__H__
+#define __CENTIPEDE__STATIC_FILES__H__
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <microhttpd.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ib/logger.h"
+#include "centipede/compression.h"
+
+#define STATIC_FILES_CAPACITY 256
+#define STATIC_FILES_PREFIX "raw__"
+#define STATIC_FILES_MAX_COMPRESS (8 << 20)
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* StaticFile is an open file together with the responses that serve it.
+ * The responses are created once and queued for every request; microhttpd
+ * reference counts them, so an entry dropped from the cache stays valid
+ * for the requests still sending it. The ok response owns the fd and sends
+ * it with sendfile where available. Each encoding of a compressible file
+ * is a representation of its own, with its own ETag and 304 response. */
+struct StaticFile {
+	StaticFile() : size(0), mtime(0), ino(0), dev(0), compressible(false),
+		       ok(nullptr) {
+		for (auto& x : not_modified) x = nullptr;
+	}
+	~StaticFile() {
+		if (ok) MHD_destroy_response(ok);
+		for (auto& x : not_modified) {
+			if (x) MHD_destroy_response(x);
+		}
+	}
+
+	string path;
+	uint64_t size;
+	time_t mtime;
+	ino_t ino;
+	dev_t dev;
+	string etag;
+	string last_modified;
+	string content_type;
+	bool compressible;
+
+	struct MHD_Response* ok;
+	struct MHD_Response* not_modified[ENCODINGS];
+	EncodedResponses encoded;
+
+	/* load: reads the whole file, for compression. */
+	void load(string* data) const {
+		data->resize(size);
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			data->clear();
+			return;
+		}
+		size_t done = 0;
+		while (done < size) {
+			ssize_t r = pread(fd, &(*data)[done], size - done, done);
+			if (r <= 0) break;
+			done += r;
+		}
+		data->resize(done);
+		close(fd);
+	}
+};
+
+/* StaticFiles serves the /raw__ files under a root directory from an LRU
+ * cache of open files. A cached file is revalidated with a stat() of its
+ * path on each request and reopened when it has changed. */
+class StaticFiles {
+public:
+	explicit StaticFiles(const string& root,
+			     size_t capacity = STATIC_FILES_CAPACITY)
+		: _capacity(capacity) {
+		set_root(root);
+	}
+
+	/* set_root: serves the raw__ entries of the directory root from now
+	 * on. Must be called before the first get. Returns false, and
+	 * serves nothing, if root cannot be resolved. */
+	bool set_root(const string& root) {
+		char buf[PATH_MAX];
+		if (!realpath(root.c_str(), buf)) {
+			Logger::error("(static) cannot resolve root %", root);
+			_root.clear();
+			return false;
+		}
+		_root = buf;
+		return true;
+	}
+
+	void set_capacity(size_t capacity) {
+		unique_lock<mutex> ul(_mutex);
+		_capacity = capacity;
+	}
+
+	/* get: returns the file for a url such as raw__/app.js, or nullptr.
+	 * Sets *forbidden if the url does not name a file under the root
+	 * whose first path component starts with raw__. */
+	shared_ptr<StaticFile> get(const string& url, bool* forbidden) {
+		*forbidden = false;
+		{
+			unique_lock<mutex> ul(_mutex);
+			auto it = _files.find(url);
+			if (it != _files.end()) {
+				shared_ptr<StaticFile> file = it->second.first;
+				_lru.splice(_lru.begin(), _lru, it->second.second);
+				ul.unlock();
+				if (fresh(*file)) return file;
+				ul.lock();
+				drop(url);
+			}
+		}
+
+		string path;
+		if (!resolve(url, &path)) {
+			*forbidden = true;
+			return nullptr;
+		}
+		shared_ptr<StaticFile> file = open_file(path);
+		if (!file) return nullptr;
+
+		unique_lock<mutex> ul(_mutex);
+		drop(url);
+		_lru.push_front(url);
+		_files[url] = make_pair(file, _lru.begin());
+		while (_files.size() > _capacity) {
+			drop(_lru.back());
+		}
+		return file;
+	}
+
+	/* not_modified: checks the conditional request headers against the
+	 * file in the encoding that would be sent. If-None-Match takes
+	 * precedence over If-Modified-Since. */
+	static bool not_modified(struct MHD_Connection* connection,
+				 const StaticFile& file, Encoding encoding) {
+		const char* inm = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND,
+			MHD_HTTP_HEADER_IF_NONE_MATCH);
+		if (inm) {
+			return strcmp(inm, "*") == 0 ||
+				strstr(inm, EncodedResponses::etag(
+					       file.etag, encoding).c_str());
+		}
+		const char* ims = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND,
+			MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+		if (!ims) return false;
+		if (file.last_modified == ims) return true;
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		if (!strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+			return false;
+		return timegm(&tm) >= file.mtime;
+	}
+
+	static string content_type(const string& path) {
+		static const map<string, string> types = {
+			{"css", "text/css; charset=utf-8"},
+			{"gif", "image/gif"},
+			{"htm", "text/html; charset=utf-8"},
+			{"html", "text/html; charset=utf-8"},
+			{"ico", "image/x-icon"},
+			{"jpeg", "image/jpeg"},
+			{"jpg", "image/jpeg"},
+			{"js", "application/javascript; charset=utf-8"},
+			{"json", "application/json"},
+			{"pdf", "application/pdf"},
+			{"png", "image/png"},
+			{"svg", "image/svg+xml"},
+			{"txt", "text/plain; charset=utf-8"},
+			{"wasm", "application/wasm"},
+			{"woff", "font/woff"},
+			{"woff2", "font/woff2"},
+		};
+		size_t dot = path.rfind('.');
+		if (dot == string::npos || path.find('/', dot) != string::npos)
+			return "application/octet-stream";
+		auto it = types.find(path.substr(dot + 1));
+		if (it == types.end()) return "application/octet-stream";
+		return it->second;
+	}
+
+	/* compressible: whether a content type is worth compressing. */
+	static bool compressible(const string& type) {
+		return !type.compare(0, 5, "text/") ||
+			!type.compare(0, 22, "application/javascript") ||
+			!type.compare(0, 16, "application/json") ||
+			!type.compare(0, 16, "application/wasm") ||
+			!type.compare(0, 13, "image/svg+xml");
+	}
+
+protected:
+	/* resolve: rejects empty, . and .. components before asking the
+	 * filesystem, then checks that the real path, with symlinks
+	 * followed, is still a raw__ entry directly under the root. */
+	bool resolve(const string& url, string* path) const {
+		if (_root.empty()) return false;
+		if (url.compare(0, strlen(STATIC_FILES_PREFIX),
+				STATIC_FILES_PREFIX)) return false;
+		size_t start = 0;
+		while (start <= url.length()) {
+			size_t end = url.find('/', start);
+			if (end == string::npos) end = url.length();
+			string piece = url.substr(start, end - start);
+			if (piece.empty() || piece == "." || piece == "..")
+				return false;
+			start = end + 1;
+		}
+		if (url.find('\0') != string::npos) return false;
+
+		char buf[PATH_MAX];
+		if (!realpath((_root + "/" + url).c_str(), buf)) return false;
+		string real = buf;
+		string prefix = _root + "/" + STATIC_FILES_PREFIX;
+		if (real.compare(0, prefix.length(), prefix)) return false;
+		*path = real;
+		return true;
+	}
+
+	shared_ptr<StaticFile> open_file(const string& path) const {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		struct stat st;
+		if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return nullptr;
+		}
+		shared_ptr<StaticFile> file(new StaticFile());
+		file->path = path;
+		file->size = st.st_size;
+		file->mtime = st.st_mtime;
+		file->ino = st.st_ino;
+		file->dev = st.st_dev;
+		file->content_type = content_type(path);
+		file->compressible = file->size <= STATIC_FILES_MAX_COMPRESS &&
+			compressible(file->content_type);
+
+		char buf[64];
+		snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+			 (unsigned long long) st.st_ino,
+			 (unsigned long long) st.st_size,
+			 (unsigned long long) st.st_mtime);
+		file->etag = buf;
+		struct tm tm;
+		gmtime_r(&file->mtime, &tm);
+		strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		file->last_modified = buf;
+
+		file->ok = MHD_create_response_from_fd64(file->size, fd);
+		if (!file->ok) {
+			close(fd);
+			return nullptr;
+		}
+		add_headers(file.get(), IDENTITY, file->ok);
+		MHD_add_response_header(file->ok,
+					MHD_HTTP_HEADER_CONTENT_TYPE,
+					file->content_type.c_str());
+		for (int i = 0; i < ENCODINGS; ++i) {
+			if (i != IDENTITY && !file->compressible) continue;
+			file->not_modified[i] = MHD_create_response_from_buffer(
+				0, nullptr, MHD_RESPMEM_PERSISTENT);
+			if (!file->not_modified[i]) return nullptr;
+			add_headers(file.get(), (Encoding) i,
+				    file->not_modified[i]);
+		}
+		file->encoded.set_etag(file->etag);
+		file->encoded.add_header(MHD_HTTP_HEADER_LAST_MODIFIED,
+					 file->last_modified);
+		file->encoded.add_header(MHD_HTTP_HEADER_CONTENT_TYPE,
+					 file->content_type);
+		return file;
+	}
+
+	/* add_headers: the validators of the file in encoding, and Vary for
+	 * a file that is sent in more than one. */
+	static void add_headers(StaticFile* file, Encoding encoding,
+				struct MHD_Response* response) {
+		MHD_add_response_header(
+			response, MHD_HTTP_HEADER_ETAG,
+			EncodedResponses::etag(file->etag, encoding).c_str());
+		MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED,
+					file->last_modified.c_str());
+		if (file->compressible) {
+			MHD_add_response_header(response, MHD_HTTP_HEADER_VARY,
+						MHD_HTTP_HEADER_ACCEPT_ENCODING);
+		}
+	}
+
+	static bool fresh(const StaticFile& file) {
+		struct stat st;
+		if (stat(file.path.c_str(), &st)) return false;
+		return st.st_ino == file.ino && st.st_dev == file.dev &&
+			st.st_mtime == file.mtime &&
+			(uint64_t) st.st_size == file.size;
+	}
+
+	/* drop: must hold _mutex */
+	void drop(const string& url) {
+		auto it = _files.find(url);
+		if (it == _files.end()) return;
+		_lru.erase(it->second.second);
+		_files.erase(it);
+	}
+
+	size_t _capacity;
+	string _root;
+	mutex _mutex;
+	list<string> _lru;
+	map<string, pair<shared_ptr<StaticFile>,
+			 list<string>::iterator>> _files;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__STATIC_FILES__H__
@@ -0,0 +1,76 @@
+#ifndef __CENTIPEDE__TIMER_WHEEL__H__
+#define __CENTIPEDE__TIMER_WHEEL__H__
+
+#include <algorithm>
+#include <vector>
+
+#include "centipede/types.h"
+
+#define TIMER_WHEEL_SLOTS 1024
+
+using namespace std;
+
+namespace centipede {
+
+/* TimerWheel is a hashed timing wheel of ClientIDs with one slot per tick.
+ * Entries are filed at the tick they are due and handed back by advance()
+ * once that tick has passed. An entry due more than TIMER_WHEEL_SLOTS ticks
+ * ahead shares its slot with nearer ones, so callers must check that an
+ * entry is really due and schedule() it again if not. The wheel is not
+ * synchronized.
+ */
+class TimerWheel {
+public:
+	TimerWheel() : _now(0) {
+		_slots.resize(TIMER_WHEEL_SLOTS);
+	}
+
+	/* schedule: files cid at tick. Ticks already passed are filed at the
+	 * next tick. */
+	void schedule(const ClientID& cid, int tick) {
+		tick = max(tick, _now + 1);
+		_slots[tick % TIMER_WHEEL_SLOTS].push_back(cid);
+	}
+
+	/* advance: moves the wheel up to now, calling f(cid) for everything
+	 * filed in the slots passed over. f may schedule() again. */
+	template<typename F>
+	void advance(int now, F f) {
+		int steps = min(now - _now, TIMER_WHEEL_SLOTS);
+		vector<ClientID> due;
+		for (int i = 1; i <= steps; ++i) {
+			due.clear();
+			due.swap(_slots[(_now + i) % TIMER_WHEEL_SLOTS]);
+			for (auto& x : due) f(x);
+		}
+		if (now > _now) _now = now;
+	}
+
+	/* earliest: calls f(cid, tick) for the entries filed for the coming
+	 * ticks, soonest first, until it returns true. f may schedule()
+	 * again; entries it has not been called for stay where they are. */
+	template<typename F>
+	void earliest(F f) {
+		vector<ClientID> due;
+		for (int i = 1; i <= TIMER_WHEEL_SLOTS; ++i) {
+			int tick = _now + i;
+			vector<ClientID>& slot = _slots[tick % TIMER_WHEEL_SLOTS];
+			due.clear();
+			due.swap(slot);
+			for (size_t j = 0; j < due.size(); ++j) {
+				if (!f(due[j], tick)) continue;
+				slot.insert(slot.end(), due.begin() + j + 1,
+					    due.end());
+				return;
+			}
+		}
+	}
+
+protected:
+	vector<vector<ClientID>> _slots;
+	int _now;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__TIMER_WHEEL__H__
@@ -0,0 +1,140 @@
+#ifndef __CENTIPEDE__UPLOAD_SPILL__H__
+#define __CENTIPEDE__UPLOAD_SPILL__H__
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/logger.h"
+#include "centipede/backend/i_upload_sink.h"
+
+#define UPLOAD_SPILL_DIR "/tmp"
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* SpillUploadSink writes each field of an upload to an unlinked temporary
+ * file as it arrives, and only when the upload has finished hands every
+ * field to the inner sink as one memory-mapped view. The backend thus
+ * sees a complete upload in a single write per field, and is never run
+ * at the pace of the network. */
+class SpillUploadSink : public IUploadSink {
+public:
+	SpillUploadSink(IUploadSink* inner, const string& dir)
+		: _inner(inner), _dir(dir), _failed(false) {}
+
+	virtual ~SpillUploadSink() {
+		for (auto& x : _fields) close(x._fd);
+	}
+
+	virtual bool write(string_view key, string_view filename,
+			   string_view content_type, string_view encoding,
+			   string_view data, uint64_t offset) {
+		if (_failed) return false;
+		if (_fields.empty() || offset == 0 ||
+		    _fields.back()._key != key ||
+		    _fields.back()._filename != filename) {
+			if (!open_field(key, filename, content_type, encoding))
+				return false;
+		}
+		Field& field = _fields.back();
+		while (!data.empty()) {
+			ssize_t r = ::write(field._fd, data.data(),
+					    data.length());
+			if (r <= 0) {
+				Logger::error("(upload_spill) write failed "
+					      "for %", string(key));
+				_failed = true;
+				return false;
+			}
+			field._size += r;
+			data.remove_prefix(r);
+		}
+		return true;
+	}
+
+	virtual void finish() {
+		if (_failed) {
+			_inner->abort();
+			return;
+		}
+		for (auto& x : _fields) {
+			if (!x._size) {
+				_inner->write(x._key, x._filename,
+					      x._content_type, x._encoding,
+					      string_view(), 0);
+				continue;
+			}
+			void* data = mmap(nullptr, x._size, PROT_READ,
+					  MAP_PRIVATE, x._fd, 0);
+			if (data == MAP_FAILED) {
+				Logger::error("(upload_spill) mmap failed "
+					      "for %", x._key);
+				_failed = true;
+				_inner->abort();
+				return;
+			}
+			bool ok = _inner->write(
+				x._key, x._filename, x._content_type,
+				x._encoding,
+				string_view((const char*) data, x._size), 0);
+			munmap(data, x._size);
+			if (!ok) {
+				_failed = true;
+				_inner->abort();
+				return;
+			}
+		}
+		_inner->finish();
+	}
+
+	virtual bool failed() const {
+		return _failed;
+	}
+
+	virtual void abort() {
+		_inner->abort();
+	}
+
+protected:
+	struct Field {
+		string _key;
+		string _filename;
+		string _content_type;
+		string _encoding;
+		int _fd;
+		size_t _size;
+	};
+
+	bool open_field(string_view key, string_view filename,
+			string_view content_type, string_view encoding) {
+		string path = _dir + "/centipede_upload_XXXXXX";
+		int fd = mkstemp(&path[0]);
+		if (fd < 0) {
+			Logger::error("(upload_spill) cannot create file in %",
+				      _dir);
+			_failed = true;
+			return false;
+		}
+		unlink(path.c_str());
+		_fields.push_back({string(key), string(filename),
+				   string(content_type), string(encoding),
+				   fd, 0});
+		return true;
+	}
+
+	unique_ptr<IUploadSink> _inner;
+	string _dir;
+	vector<Field> _fields;
+	bool _failed;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__UPLOAD_SPILL__H__
@@ -0,0 +1,137 @@
+#ifndef __CENTIPEDE__URL_ROUTER__H__
+#define __CENTIPEDE__URL_ROUTER__H__
+
+#include <charconv>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "centipede/types.h"
+
+#define URL_MAX_SEGMENTS 32
+
+using namespace std;
+
+namespace centipede {
+
+/* Route is what a request url asks for, decided by its second segment. */
+enum Route {
+	ROUTE_NEW_SESSION,	/* / or /?... */
+	ROUTE_PAGE,		/* /cid */
+	ROUTE_GET,		/* /cid/get/key/parameters... */
+	ROUTE_SET,		/* /cid/set/key/parameters... */
+	ROUTE_RESOURCE,		/* /cid/resource/rid[/ject] */
+	ROUTE_COMMAND,		/* /cid/command/name/parameters... */
+	ROUTE_CALL,		/* /cid/call/name/parameters... */
+	ROUTE_SOCKET,		/* /cid/socket, a WebSocket upgrade */
+	ROUTE_BATCH,		/* /cid/batch, operations in a POST body */
+	ROUTE_UNKNOWN,
+};
+
+/* ParsedUrl splits a request url in one pass into views of its non-empty
+ * /-separated segments, without copying, and resolves the client and the
+ * route. The views point into the url, which must outlive it. */
+class ParsedUrl {
+public:
+	ParsedUrl() : _size(0), _cid(0), _route(ROUTE_UNKNOWN) {}
+	ParsedUrl(string_view url) {
+		parse(url);
+	}
+
+	/* parse: returns false if the url has more than URL_MAX_SEGMENTS
+	 * segments. */
+	bool parse(string_view url) {
+		_url = url;
+		_size = 0;
+		_cid = 0;
+		_route = ROUTE_UNKNOWN;
+		size_t pos = 0;
+		while (pos < url.length()) {
+			if (url[pos] == '/') {
+				++pos;
+				continue;
+			}
+			size_t end = url.find('/', pos);
+			if (end == string_view::npos) end = url.length();
+			if (_size == URL_MAX_SEGMENTS) return false;
+			_segments[_size++] = url.substr(pos, end - pos);
+			pos = end;
+		}
+
+		if (!_size || _segments[0][0] == '?') {
+			_route = ROUTE_NEW_SESSION;
+			return true;
+		}
+		/* as with stream extraction, the cid is the leading digits */
+		from_chars(_segments[0].data(),
+			   _segments[0].data() + _segments[0].length(), _cid);
+		if (_size == 1) _route = ROUTE_PAGE;
+		else _route = lookup(_segments[1]);
+		return true;
+	}
+
+	const string_view& url() const {
+		return _url;
+	}
+
+	size_t size() const {
+		return _size;
+	}
+
+	const string_view& operator[](size_t i) const {
+		return _segments[i];
+	}
+
+	const ClientID& cid() const {
+		return _cid;
+	}
+
+	Route route() const {
+		return _route;
+	}
+
+	/* arguments: copies the segments from start onwards. */
+	void arguments(size_t start, vector<string>* output) const {
+		for (size_t i = start; i < _size; ++i) {
+			output->emplace_back(_segments[i]);
+		}
+	}
+
+	void arguments(size_t start, pmr::vector<string_view>* output) const {
+		if (start < _size) output->reserve(_size - start);
+		for (size_t i = start; i < _size; ++i) {
+			output->push_back(_segments[i]);
+		}
+	}
+
+	static Route lookup(string_view verb) {
+		static const struct {
+			string_view name;
+			Route route;
+		} routes[] = {
+			{"get", ROUTE_GET},
+			{"set", ROUTE_SET},
+			{"resource", ROUTE_RESOURCE},
+			{"command", ROUTE_COMMAND},
+			{"call", ROUTE_CALL},
+			{"socket", ROUTE_SOCKET},
+			{"batch", ROUTE_BATCH},
+		};
+		for (auto& x : routes) {
+			if (x.name == verb) return x.route;
+		}
+		return ROUTE_UNKNOWN;
+	}
+
+protected:
+	string_view _url;
+	string_view _segments[URL_MAX_SEGMENTS];
+	size_t _size;
+	ClientID _cid;
+	Route _route;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__URL_ROUTER__H__
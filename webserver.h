@@ -2,10 +2,12 @@
 #define __IB__WEB__WEBSERVER__H__
 
 #include <arpa/inet.h>
+#include <atomic>
 #include <cassert>
 #include <dirent.h>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <map>
 #include <microhttpd.h>
 #include <set>
@@ -16,9 +18,27 @@
 #include "ib/entropy.h"
 #include "ib/logger.h"
 #include "ib/tiny_timer.h"
+#include "centipede/access_log.h"
+#include "centipede/async_reply.h"
 #include "centipede/backend/i_webserver_backend.h"
+#include "centipede/compression.h"
+#include "centipede/fragment_patch.h"
+#include "centipede/metrics.h"
+#include "centipede/rate_limiter.h"
+#include "centipede/render_cache.h"
+#include "centipede/request_arena.h"
+#include "centipede/resource_stream.h"
+#include "centipede/session_store.h"
+#include "centipede/static_files.h"
+#include "centipede/upload_spill.h"
+#include "centipede/url_router.h"
+#include "centipede/websocket.h"
+#include "centipede/worker_proxy.h"
 
-#define POST_BUFFER_SIZE 1024
+#define POST_BUFFER_SIZE 65536
+#define BATCH_MAX_BYTES (1 << 20)
+#define SESSION_SNAPSHOT_PATH "centipede.sessions"
+#define DEFAULT_SERVER_THREADS 4
 
 using namespace ib;
 using namespace std;
@@ -39,32 +59,189 @@ static void request_completed(void* cls,
 			      void **con_cls,
 			      enum MHD_RequestTerminationCode toe);
 
-class WebServer {
+static int send_page(struct MHD_Connection *connection,
+		     const string& output,
+		     unsigned int status = MHD_HTTP_OK);
+
+static void upgrade_socket_cb(void* cls,
+			      struct MHD_Connection* connection,
+			      void* con_cls,
+			      const char* extra_in,
+			      size_t extra_in_size,
+			      int sock,
+			      struct MHD_UpgradeResponseHandle* urh);
+
+/* ServerMode selects how microhttpd schedules connections. It is read
+ * from the server_mode config value. */
+enum ServerMode {
+	/* one thread, and its stack, for every open connection */
+	THREAD_PER_CONNECTION = 0,
+	/* a single internal thread multiplexing all connections */
+	SELECT_INTERNALLY = 1,
+	/* server_threads threads, each running its own epoll loop */
+	EPOLL_THREAD_POOL = 2,
+};
+
+class WebServer : public IClientPush {
 public:
 	WebServer(IWebserverBackend* backend)
-		: _alive(false), _backend(backend) {}
+		: _alive(false), _backend(backend), _can_suspend(false),
+		  _post_buffer_size(POST_BUFFER_SIZE), _upload_spill(false),
+		  _upload_spill_dir(UPLOAD_SPILL_DIR),
+		  _snapshot_path(SESSION_SNAPSHOT_PATH), _local_daemon(nullptr),
+		  _worker_index(0), _worker_count(0), _static_files("."),
+		  _metrics_enabled(false), _max_sessions(0), _rejected(nullptr),
+		  _patch_script(nullptr) {
+		_backend->set_push(this);
+	}
 
+	/* start_server: besides the housekeeping values, the following
+	 * optional config values are used. Zero or unset means the default.
+	 *   server_mode          a ServerMode, THREAD_PER_CONNECTION default
+	 *   server_threads       pool size for EPOLL_THREAD_POOL
+	 *   connection_limit     maximum concurrent connections
+	 *   connection_timeout_s idle seconds before a connection is closed
+	 *   static_files_capacity raw__ files kept open
+	 *   render_cache_bytes   budget for cached pages, 0 disables
+	 *   compression_level    zlib level 1-9, negative disables
+	 *   compression_min_bytes smallest body worth compressing
+	 *   post_buffer_size     bytes the POST processor decodes at a time
+	 *   upload_spill         if set, uploads are spooled to disk, in
+	 *                        the set_upload_spill_dir directory, and
+	 *                        handed over whole when complete
+	 *   session_snapshot_slots if set, sessions are saved to the
+	 *                        snapshot file, up to this many, and the
+	 *                        ones saved by the last run are restored
+	 *   metrics              if set, /metrics__ serves the Metrics
+	 *   access_log_sample    log one request in this many to the access
+	 *                        log, if set_access_log was called
+	 *   access_log_flush_ms  how often the access log is written out
+	 *   max_sessions         sessions kept at most; beyond it the least
+	 *                        recently active are ended
+	 *   new_session_rate, new_session_burst
+	 *                        sessions a second each address may start,
+	 *                        and how many at once
+	 *   request_rate, request_burst
+	 *                        the same for every request
+	 *   socket_threads       threads serving WebSocket messages
+	 *   workers, worker_index the number of worker processes sharing
+	 *                        the port, and which one this is, unless
+	 *                        given to set_worker
+	 */
 	void start_server(int port) {
 		assert(port);
+		if (!_worker_count) {
+			_worker_count = config_or("workers", 1);
+			_worker_index = Config::_()->get("worker_index");
+		}
+		_proxy.configure(_worker_index, _worker_count, port);
+		_sessions.set_life_period(Config::_()->get("life_period"));
+		int snapshot_slots = Config::_()->get("session_snapshot_slots");
+		if (snapshot_slots > 0) restore_sessions(snapshot_slots);
+		_static_files.set_capacity(config_or("static_files_capacity",
+						     STATIC_FILES_CAPACITY));
+		_render_cache.set_capacity(config_or("render_cache_bytes", 0));
+		int level = Config::_()->get("compression_level");
+		_compression.set_level(level ? level : COMPRESSION_LEVEL);
+		_compression.set_min_bytes(config_or("compression_min_bytes",
+						     COMPRESSION_MIN_BYTES));
+		_post_buffer_size = config_or("post_buffer_size",
+					      POST_BUFFER_SIZE);
+		_upload_spill = Config::_()->get("upload_spill") > 0;
+		if (_upload_spill &&
+		    access(_upload_spill_dir.c_str(), W_OK | X_OK)) {
+			Logger::error("(upload_spill) cannot write to %; "
+				      "uploads are not spooled",
+				      _upload_spill_dir);
+			_upload_spill = false;
+		}
+		_metrics_enabled = Config::_()->get("metrics") > 0;
+		if (!_access_log_path.empty()) {
+			_access_log.open(_access_log_path,
+					 Config::_()->get("access_log_sample"),
+					 Config::_()->get("access_log_flush_ms"));
+		}
+		_max_sessions = config_or("max_sessions", 0);
+		int rate = Config::_()->get("new_session_rate");
+		_session_limiter.configure(
+			rate, config_or("new_session_burst", rate));
+		rate = Config::_()->get("request_rate");
+		_request_limiter.configure(
+			rate, config_or("request_burst", rate));
+		_rejected = MHD_create_response_from_buffer(
+			strlen("too many requests"), (void *) "too many requests",
+			MHD_RESPMEM_PERSISTENT);
+		MHD_add_response_header(_rejected, MHD_HTTP_HEADER_RETRY_AFTER,
+					"1");
+		_patch_script = MHD_create_response_from_buffer(
+			strlen(FragmentPatch::script()),
+			(void *) FragmentPatch::script(),
+			MHD_RESPMEM_PERSISTENT);
+		MHD_add_response_header(_patch_script,
+					MHD_HTTP_HEADER_CONTENT_TYPE,
+					"application/javascript");
+		int mode = Config::_()->get("server_mode");
+		unsigned int flags;
+		vector<MHD_OptionItem> options;
+		options.push_back({MHD_OPTION_NOTIFY_COMPLETED,
+				   (intptr_t) &request_completed, nullptr});
+		if (mode == EPOLL_THREAD_POOL) {
+			flags = MHD_USE_EPOLL_INTERNALLY |
+				MHD_ALLOW_SUSPEND_RESUME;
+			int threads = config_or("server_threads",
+						DEFAULT_SERVER_THREADS);
+			options.push_back({MHD_OPTION_THREAD_POOL_SIZE,
+					   threads, nullptr});
+		} else if (mode == SELECT_INTERNALLY) {
+			flags = MHD_USE_SELECT_INTERNALLY |
+				MHD_ALLOW_SUSPEND_RESUME;
+		} else {
+			flags = MHD_USE_THREAD_PER_CONNECTION;
+		}
+		int connection_limit = Config::_()->get("connection_limit");
+		if (connection_limit > 0) {
+			options.push_back({MHD_OPTION_CONNECTION_LIMIT,
+					   connection_limit, nullptr});
+		}
+		int connection_timeout = Config::_()->get(
+			"connection_timeout_s");
+		if (connection_timeout > 0) {
+			options.push_back({MHD_OPTION_CONNECTION_TIMEOUT,
+					   connection_timeout, nullptr});
+		}
+		vector<MHD_OptionItem> local_options = options;
+		if (_proxy.enabled()) {
+			options.push_back({MHD_OPTION_LISTENING_ADDRESS_REUSE,
+					   1, nullptr});
+		}
+		options.push_back({MHD_OPTION_END, 0, nullptr});
+		_can_suspend = flags != MHD_USE_THREAD_PER_CONNECTION;
+		flags |= MHD_ALLOW_UPGRADE;
+
 		_daemon = MHD_start_daemon(
-			MHD_USE_THREAD_PER_CONNECTION,
-			// MHD_USE_SELECT_INTERNALLY, is the alternate
+			flags,
 			port,
 			nullptr,
 			nullptr,
 			&http_serv,
 			(void *) this,
-			MHD_OPTION_NOTIFY_COMPLETED,
-			&request_completed,
-			nullptr,
+			MHD_OPTION_ARRAY,
+			options.data(),
 			MHD_OPTION_END);
 		if (_daemon == nullptr) {
 			Logger::error("Failure to create http server "
-			 	      "on port %", port);
+			 	      "on port % in mode %", port, mode);
 
 			assert(0);
 		}
+		if (_proxy.enabled()) {
+			_proxy.start();
+			start_local_daemon(flags, &local_options);
+		}
 		_alive = true;
+		_sockets.start([this](const ClientID& cid, const string& message) {
+			return socket_message(cid, message);
+		}, config_or("socket_threads", WEBSOCKET_THREADS));
 		_housekeeping_thread.reset(new thread(
 			&WebServer::housekeeping_thread, this));
 	}
@@ -76,212 +253,826 @@ public:
 			_alive = false;
 		}
 		_housekeeping_thread->join();
+		_sockets.stop();
 		MHD_stop_daemon(_daemon);
+		_proxy.stop();
+		_access_log.close();
+		MHD_destroy_response(_rejected);
+		_rejected = nullptr;
+		MHD_destroy_response(_patch_script);
+		_patch_script = nullptr;
+		if (_local_daemon) {
+			MHD_stop_daemon(_local_daemon);
+			_local_daemon = nullptr;
+			unlink(_proxy.socket_path(_worker_index).c_str());
+		}
+		_sessions.flush_snapshot(true);
 	}
 
-	int recv_post(const string& url,
-		      const string& key, const string& filename,
-                      const string& content_type, const string& encoding,
-                      const string& data, uint64_t offset,
-                      size_t size, string* output) {
-		vector<string> pieces;
-		split_url(url, &pieces);
-		if (!pieces.size()) {
-			Logger::error("recv_post(): no pieces in %", url);
-			throw "invalid request";
+	/* set_worker: makes this server worker index of workers processes
+	 * listening on the same port, each owning the sessions it creates.
+	 * WorkerProxy::fork_workers gives each forked process its index.
+	 * Must be called before start_server. */
+	void set_worker(int index, int workers) {
+		assert(index >= 0 && index < workers);
+		assert(workers <= (1 << WORKER_BITS));
+		_worker_index = index;
+		_worker_count = workers;
+	}
+
+	/* foreign: whether the request's session belongs to another worker
+	 * and must be forwarded. Requests that were forwarded once are
+	 * served here whatever the cid says. */
+	bool foreign(const ParsedUrl& pieces,
+		     struct MHD_Connection* connection) const {
+		return _proxy.foreign(pieces.cid()) && !forwarded(connection);
+	}
+
+	/* forwarded: whether the request was forwarded by another worker.
+	 * WORKER_FORWARDED_HEADER is only believed on the local daemon, which
+	 * only the workers can reach; on the public port any client could
+	 * send it. */
+	bool forwarded(struct MHD_Connection* connection) const {
+		if (!_local_daemon) return false;
+		const union MHD_ConnectionInfo* info = MHD_get_connection_info(
+			connection, MHD_CONNECTION_INFO_DAEMON);
+		return info && info->daemon == _local_daemon &&
+			MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+						    WORKER_FORWARDED_HEADER);
+	}
+
+	/* open_proxy: starts passing a request to the worker that owns its
+	 * session. Returns nullptr on failure. */
+	shared_ptr<ProxyRequest> open_proxy(struct MHD_Connection* connection,
+					    const ParsedUrl& pieces,
+					    const string& method,
+					    const string& url) {
+		shared_ptr<ProxyRequest> proxy(new ProxyRequest(
+			&_proxy, _proxy.owner(pieces.cid()), connection,
+			_can_suspend));
+		if (!proxy->begin(method, url, client_address(connection))) {
+			proxy->abandon();
+			return nullptr;
 		}
-		ClientID cid = atoll(pieces[0].c_str());
+		return proxy;
+	}
 
-		unique_lock<mutex> ul(_mutex);
-		if (!is_client(cid)) {
-			build_redirect(output);
-			return 0;
+	static const struct sockaddr* client_sockaddr(
+			struct MHD_Connection* connection) {
+		const union MHD_ConnectionInfo* info = MHD_get_connection_info(
+			connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+		return info ? info->client_addr : nullptr;
+	}
+
+	static string client_address(struct MHD_Connection* connection) {
+		char ipbuf[INET6_ADDRSTRLEN + 1];
+		const struct sockaddr* addr = client_sockaddr(connection);
+		if (!addr) return "local";
+		const void* host = nullptr;
+		if (addr->sa_family == AF_INET) {
+			host = &((const struct sockaddr_in*) addr)->sin_addr;
+		} else if (addr->sa_family == AF_INET6) {
+			host = &((const struct sockaddr_in6*) addr)->sin6_addr;
 		}
-		client_alive(cid);
+		if (!host || !inet_ntop(addr->sa_family, host, ipbuf,
+					sizeof(ipbuf))) {
+			return "local";
+		}
+		return ipbuf;
+	}
+
+	/* set_access_log: turns on the AccessLog, appending to path. Must be
+	 * called before start_server. */
+	void set_access_log(const string& path) {
+		_access_log_path = path;
+	}
+
+	AccessLog* access_log() {
+		return &_access_log;
+	}
 
-		if (pieces.size() < 3 || pieces[1] != "command") {
-			Logger::error("recv_post(): bad url %", url);
+	/* set_static_root: the directory whose raw__ entries are served,
+	 * the working directory by default. Must be called before
+	 * start_server. */
+	void set_static_root(const string& path) {
+		_static_files.set_root(path);
+	}
+
+	/* set_upload_spill_dir: the directory uploads are spooled to,
+	 * UPLOAD_SPILL_DIR by default. Must be called before start_server. */
+	void set_upload_spill_dir(const string& path) {
+		_upload_spill_dir = path;
+	}
+
+	/* set_snapshot_path: the session snapshot file, SESSION_SNAPSHOT_PATH
+	 * by default. Must be called before start_server. */
+	void set_snapshot_path(const string& path) {
+		_snapshot_path = path;
+	}
+
+	/* open_upload: returns the sink, owned by the caller, for a POST to
+	 * /cid/command/name. The session is looked up once here rather than
+	 * for every chunk. */
+	IUploadSink* open_upload(const ParsedUrl& pieces) {
+		int state;
+		if (!_sessions.touch(pieces.cid(), sensible_time::runtime(),
+				     &state)) {
+			throw "unknown client";
+		}
+		if (pieces.size() < 3 || pieces.route() != ROUTE_COMMAND) {
+			Logger::error("open_upload(): bad url %",
+				      string(pieces.url()));
 			throw "invalid request";
 		}
-		int finished = _backend->recv_post(
-			cid, pieces[2], key, filename,
-			content_type, encoding, data,
-			offset, size, output);
-		return MHD_YES;
-		return finished ? MHD_YES : MHD_NO;
+		IUploadSink* sink;
+		{
+			BackendTimer timer(&_metrics, BACKEND_OPEN_UPLOAD);
+			sink = _backend->open_upload(pieces.cid(), state,
+						     string(pieces[2]));
+		}
+		if (sink && _upload_spill) {
+			sink = new SpillUploadSink(sink, _upload_spill_dir);
+		}
+		return sink;
 	}
 
+	size_t post_buffer_size() const {
+		return _post_buffer_size;
+	}
+
+	/* log_connection: a hook to refuse a request before it is served,
+	 * answering with output. Requests are logged by the AccessLog. */
 	virtual bool log_connection(struct MHD_Connection* conn,
 				    const string& url,
 				    const string& method,
 				    string* output) {
-		char ipbuf[INET6_ADDRSTRLEN + 1];
-		struct sockaddr_in* addr = * (struct sockaddr_in**)
-			MHD_get_connection_info(
-				conn,
-				MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-
-		inet_ntop(addr->sin_family,
-			  &addr->sin_addr,
-			  ipbuf, INET6_ADDRSTRLEN);
-		ipbuf[INET6_ADDRSTRLEN] = 0;
-/*		Logger::info("(webserver) %:% requests %",
-			ipbuf, ntohs(addr->sin_port),
-			url);*/
 		return true;
 	}
 
 	bool early_abort(const string& url, string* output) {
-		vector<string> pieces;
-		split_url(url, &pieces);
-		if (!pieces.size() || pieces[0][0] == '?') {
-			unique_lock<mutex> ul(_mutex);
+		ParsedUrl pieces;
+		if (!pieces.parse(url)) {
+			build_redirect(output);
+			return true;
+		}
+		return early_abort(pieces, output);
+	}
+
+	/* early_abort: answers requests that need no client session: new
+	 * sessions and redirects for unknown clients. */
+	bool early_abort(const ParsedUrl& pieces, string* output) {
+		if (pieces.route() == ROUTE_NEW_SESSION) {
 			ClientID cid = new_session();
-			_state[cid] = 0;
-			client_alive(cid);
 			build_output(cid, output);
 			return true;
 		}
-		stringstream ss;
-		ss << pieces[0];
-		ClientID cid;
-		ss >> cid;
-		unique_lock<mutex> ul(_mutex);
-		if (!is_client(cid)) {
+		if (!is_client(pieces.cid())) {
 			build_redirect(output);
 			return true;
 		}
 		return false;
 	}
 
-	void raw_url(const string& url, string* output) const {
-		if (url.find("..") != string::npos) {
+	/* raw_url: serves a raw__ file straight from the StaticFiles cache,
+	 * answering conditional requests with 304 Not Modified. The fragment
+	 * patch script is built in. */
+	int raw_url(struct MHD_Connection* connection, const string& url) {
+		if (url == FRAGMENT_SCRIPT_URL) {
+			sent(strlen(FragmentPatch::script()));
+			return MHD_queue_response(connection, MHD_HTTP_OK,
+						  _patch_script);
+		}
+		bool forbidden;
+		shared_ptr<StaticFile> file = _static_files.get(url, &forbidden);
+		if (forbidden) {
 			Logger::error("security violation: %", url);
-			build_redirect(output);
-			return;
+			string output;
+			build_redirect(&output);
+			return send_page(connection, output);
 		}
-		stringstream ss;
-		ifstream fin(url);
-		ss << fin.rdbuf();
-		if (ss.str().length() == 0) {
-			Logger::error("raw_url(): empty data for %", url);
-			*output = "<html><body>[data not available]</body></html>";
-		} else {
-			*output = ss.str();
+		if (!file) {
+			Logger::error("raw_url(): no data for %", url);
+			return send_page(
+				connection,
+				"<html><body>[data not available]</body></html>",
+				MHD_HTTP_NOT_FOUND);
+		}
+		/* the encoding is settled first, as each has its own ETag */
+		Encoding encoding = IDENTITY;
+		struct MHD_Response* response = file->ok;
+		size_t bytes = file->size;
+		if (file->compressible) {
+			Encoding accepted = _compression.negotiate(connection,
+								   file->size);
+			size_t compressed;
+			struct MHD_Response* encoded = accepted == IDENTITY ?
+				nullptr : file->encoded.get(
+					&_compression, accepted,
+					[&file](string* data) { file->load(data); },
+					&compressed);
+			if (encoded) {
+				encoding = accepted;
+				response = encoded;
+				bytes = compressed;
+			}
+		}
+		if (StaticFiles::not_modified(connection, *file, encoding)) {
+			AccessLog::reply(MHD_HTTP_NOT_MODIFIED);
+			return MHD_queue_response(connection,
+						  MHD_HTTP_NOT_MODIFIED,
+						  file->not_modified[encoding]);
+		}
+		if (encoding != IDENTITY) _compression.count(file->size, bytes);
+		sent(bytes);
+		return MHD_queue_response(connection, MHD_HTTP_OK, response);
+	}
+
+	/* send_output: sends a reply, compressed if the client accepts it and
+	 * it is large enough. A page served from the render cache is only
+	 * compressed the first time. */
+	int send_output(struct MHD_Connection* connection,
+			const string& output) {
+		Encoding encoding = _compression.negotiate(connection,
+							   output.length());
+		if (encoding == IDENTITY) {
+			sent(output.length());
+			return send_page(connection, output);
+		}
+
+		shared_ptr<CachedPage>& page = reply_page();
+		if (page && page->data == output) {
+			size_t compressed;
+			struct MHD_Response* response = page->encoded.get(
+				&_compression, encoding,
+				[&output](string* data) { *data = output; },
+				&compressed);
+			page.reset();
+			if (!response) {
+				sent(output.length());
+				return send_page(connection, output);
+			}
+			_compression.count(output.length(), compressed);
+			sent(compressed);
+			return MHD_queue_response(connection, MHD_HTTP_OK,
+						  response);
+		}
+
+		string body;
+		if (!_compression.compress(output.data(), output.length(),
+					   encoding, &body)) {
+			sent(output.length());
+			return send_page(connection, output);
+		}
+		struct MHD_Response* response =
+			Compression::create_response(body, encoding);
+		int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		MHD_destroy_response(response);
+		_compression.count(output.length(), body.length());
+		sent(body.length());
+		return ret;
+	}
+
+	/* stream_resource: serves /cid/resource/rid[/ject] from the
+	 * backend's open_resource, if it has one for it, setting *ret.
+	 * Returns false for get_resource to serve it instead. */
+	bool stream_resource(struct MHD_Connection* connection,
+			     const ParsedUrl& pieces, int* ret) {
+		if (pieces.route() != ROUTE_RESOURCE || pieces.size() < 3)
+			return false;
+		ClientID cid = pieces.cid();
+		if (!_sessions.touch(cid, sensible_time::runtime())) {
+			Logger::error("stream_resource(): % not client", cid);
+			throw "unknown client";
+		}
+		ResourceID rid = 0;
+		from_chars(pieces[2].data(),
+			   pieces[2].data() + pieces[2].length(), rid);
+		string ject = "";
+		if (pieces.size() == 4) ject = pieces[3];
+		ResourceBody body;
+		{
+			BackendTimer timer(&_metrics, BACKEND_OPEN_RESOURCE);
+			if (!_backend->open_resource(cid, rid, ject, &body))
+				return false;
+		}
+		unsigned int status;
+		uint64_t bytes;
+		*ret = ResourceStream::send(connection, &body, &status, &bytes);
+		AccessLog::reply(status);
+		sent(bytes);
+		return true;
+	}
+
+	/* metrics_url: serves the Metrics in the Prometheus text format, if
+	 * enabled. */
+	int metrics_url(struct MHD_Connection* connection) {
+		if (!_metrics_enabled) {
+			return send_page(connection, "", MHD_HTTP_NOT_FOUND);
+		}
+		Metrics::State state;
+		state.sessions = _sessions.size();
+		state.lock_acquisitions = _sessions.lock_acquisitions();
+		state.lock_contended = _sessions.lock_contended();
+		state.lock_wait_us = _sessions.lock_wait_us();
+		state.bytes_saved = _compression.bytes_saved();
+		string output;
+		_metrics.format(state, &output);
+		struct MHD_Response* response = MHD_create_response_from_buffer(
+			output.length(), (void *) output.c_str(),
+			MHD_RESPMEM_MUST_COPY);
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+					"text/plain; version=0.0.4");
+		int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		MHD_destroy_response(response);
+		return ret;
+	}
+
+	Metrics* metrics() {
+		return &_metrics;
+	}
+
+	/* metric_route: the MetricRoute a request is timed under, or
+	 * METRIC_ROUTES for those that are not timed. */
+	static MetricRoute metric_route(const ParsedUrl& pieces) {
+		switch (pieces.route()) {
+		case ROUTE_NEW_SESSION: return METRIC_NEW_SESSION;
+		case ROUTE_PAGE: return METRIC_PAGE;
+		case ROUTE_GET: return METRIC_GET;
+		case ROUTE_SET: return METRIC_SET;
+		case ROUTE_RESOURCE: return METRIC_RESOURCE;
+		case ROUTE_COMMAND:
+		case ROUTE_CALL:
+			if (pieces.size() > 2 && pieces[2] == "for_a_node")
+				return METRIC_FOR_A_NODE;
+			return pieces.route() == ROUTE_COMMAND ?
+				METRIC_COMMAND : METRIC_CALL;
+		case ROUTE_BATCH: return METRIC_BATCH;
+		default: return METRIC_ROUTES;
 		}
 	}
 
-	int geturl(const string& url, const map<string, string>& args,
+	/* reply_page: the cached page behind the reply being built on this
+	 * thread, if any. http_serv clears it for every request. */
+	static shared_ptr<CachedPage>& reply_page() {
+		thread_local shared_ptr<CachedPage> page;
+		return page;
+	}
+
+	int geturl(const string& url, const ArgumentViews& args,
 		   string* output) {
+		ParsedUrl pieces;
+		if (!pieces.parse(url)) {
+			Logger::error("geturl() % too many pieces", url);
+			throw "invalid request";
+		}
+		return geturl(pieces, args, output);
+	}
+
+	/* geturl: serves a request. held says the caller already holds the
+	 * session's write mark, as wait_write takes it; otherwise a route
+	 * that writes waits for it here. */
+	int geturl(const ParsedUrl& pieces, const ArgumentViews& args,
+		   string* output, bool held = false) {
 		// TinyTimer tt("geturl");
-		unique_lock<mutex> ul(_mutex);
 		assert(output);
-		vector<string> pieces;
-		split_url(url, &pieces);
 		if (!pieces.size()) {
-			Logger::error("geturl() % % pieces empty",
-				      url, args);
+			Logger::error("geturl() % pieces empty",
+				      string(pieces.url()));
 			throw "no client";
 		}
 
-		stringstream ss;
-		ss << pieces[0];
-		ClientID cid;
-		ss >> cid;
-
-		if (!is_client(cid)) {
+		ClientID cid = pieces.cid();
+		SessionWriter writer(writes(pieces.route()) && !held ?
+				     &_sessions : nullptr, cid);
+		int state;
+		if (!_sessions.touch(cid, sensible_time::runtime(), &state)) {
 			Logger::error("geturl(): % not client", cid);
 			throw "unknown client";
 		}
+		return serve(pieces, args, &state, output);
+	}
 
-		client_alive(cid);
+	/* writes: whether a route changes the session, and so must hold its
+	 * write mark from reading the state to storing the new one. */
+	static bool writes(Route route) {
+		return route == ROUTE_SET || route == ROUTE_COMMAND ||
+			route == ROUTE_CALL;
+	}
+
+	/* serve: runs a request for a client whose session has already been
+	 * looked up and is in *state. A command updates *state. The caller
+	 * holds the session's write mark if the route writes. */
+	int serve(const ParsedUrl& pieces, const ArgumentViews& args,
+		  int* state, string* output) {
+		ClientID cid = pieces.cid();
+		Route route = pieces.route();
 		/* hostname/cid */
-		if (pieces.size() == 1) {
+		if (route == ROUTE_PAGE) {
 			build_output(cid, output);
 			return 0;
 		}
+		if (route == ROUTE_UNKNOWN) {
+			Logger::error("url prefix % not found.",
+				      string(pieces[1]));
+			return -1;
+		}
+		if (pieces.size() < 3) {
+			Logger::error("geturl(): % not enough parameters",
+				      string(pieces.url()));
+			throw "invalid request";
+		}
 
-		if (pieces[1] == "get") {
-			if (pieces.size() < 3) {
-				Logger::error("geturl(): % % not enough "
-					      "parameters", url, args);
-				throw "invalid request";
-			}
-                        vector<string> arguments;
-                        string key = pieces[2];
-			int i = 3;
-			while (pieces.size() > i) {
-                                arguments.push_back(pieces[i]);
-                                ++i;
-                        }
-			_backend->get_value(cid, _state[cid],
-					    key, arguments, args, output);
+		ParameterViews arguments(RequestArena::get());
+		switch (route) {
+		case ROUTE_GET: {
+			pieces.arguments(3, &arguments);
+			OutputSink sink(output);
+			BackendTimer timer(&_metrics, BACKEND_GET_VALUE);
+			_backend->get_value(cid, *state, pieces[2], arguments,
+					    args, &sink);
 			return 0;
 		}
-		if (pieces[1] == "set") {
-			if (pieces.size() < 3) {
-				Logger::error("geturl(): % % not enough "
-					      "parameters", url, args);
-				throw "invalid request";
-			}
-                        vector<string> arguments;
-                        string key = pieces[2];
-			int i = 3;
-			while (pieces.size() > i) {
-                                arguments.push_back(pieces[i]);
-                                ++i;
-                        }
-			if (_backend->set_value(cid, _state[cid],
-					    key, arguments, args)) {
+		case ROUTE_SET: {
+			pieces.arguments(3, &arguments);
+			BackendTimer timer(&_metrics, BACKEND_SET_VALUE);
+			if (_backend->set_value(cid, *state, pieces[2], arguments,
+						args)) {
 				*output = "";
 			} else {
 				*output = "error";
 			}
+			save_blob(cid, *state);
 			return 0;
 		}
-		if (pieces[1] == "resource") {
-			if (pieces.size() < 3) {
-				Logger::error("geturl(): % % not enough "
-                                             "parameters", url, args);
-                                throw "invalid request";
-			}
-			ResourceID rid = atoll(pieces[2].c_str());
+		case ROUTE_RESOURCE: {
+			ResourceID rid = 0;
+			from_chars(pieces[2].data(),
+				   pieces[2].data() + pieces[2].length(), rid);
 			string ject = "";
 			if (pieces.size() == 4) ject = pieces[3];
+			BackendTimer timer(&_metrics, BACKEND_GET_RESOURCE);
 			_backend->get_resource(cid, rid, ject, output);
 			return 0;
 		}
-
-		if (pieces[1] == "command" || pieces[1] == "call") {
-			if (pieces.size() < 3) {
-				Logger::error("geturl(): % % not enough "
-                                             "parameters", url, args);
-                                throw "invalid request";
-			}
-			vector<string> arguments;
-			string command = pieces[2];
-			int i = 3;
-			if (command == "for_a_node") i += 2;
-
-			while (pieces.size() > i) {
-				arguments.push_back(pieces[i]);
-				++i;
-			}
-			if (command == "for_a_node") {
+		case ROUTE_COMMAND:
+		case ROUTE_CALL: {
+			/* since__ is read here, and not passed on */
+			uint64_t since;
+			bool patch = FragmentPatch::since(args, &since);
+			ArgumentViews stripped(RequestArena::get());
+			const ArgumentViews& command_args =
+				without_since(args, &stripped);
+			if (pieces[2] == "for_a_node") {
+				if (pieces.size() < 5) {
+					Logger::error("geturl(): % not enough "
+						      "parameters",
+						      string(pieces.url()));
+					throw "invalid request";
+				}
+				pieces.arguments(5, &arguments);
+				BackendTimer timer(&_metrics,
+						   BACKEND_RUN_NODE_COMMAND);
 				_backend->run_node_command(
-					cid, _state[cid],
-					pieces[3], pieces[4], arguments, args);
+					cid, *state,
+					string(pieces[3]), string(pieces[4]),
+					to_strings(arguments),
+					to_strings(command_args));
+				save_blob(cid, *state);
 			} else {
-				_state[cid] = _backend->run_command(
-					cid, _state[cid],
-					command, arguments, args);
+				pieces.arguments(3, &arguments);
+				{
+					BackendTimer timer(&_metrics,
+							   BACKEND_RUN_COMMAND);
+					*state = _backend->run_command(
+						cid, *state, pieces[2],
+						arguments, command_args);
+				}
+				_sessions.set_state(cid, *state);
+				save_blob(cid, *state);
 			}
-			if (pieces[1] == "call") *output = "";
-			else build_output(cid, output);
+			if (route == ROUTE_CALL) *output = "";
+			else if (!patch ||
+				 !build_patch(cid, *state, since, output))
+				build_output(cid, output);
 			return 0;
 		}
-		Logger::error("url prefix % not found.", pieces[1]);
-		return -1;
+		default:
+			return -1;
+		}
+	}
+
+	/* run_batch: serves a POST to /cid/batch. Each line of the body is
+	 * an operation as it would follow /cid/ in a url, with an optional
+	 * ?key=value&... query, such as get/key/a or command/next?x=1. The
+	 * session is looked up once for the whole batch and the operations
+	 * run in order. Each result is framed as "ok <length>\n<output>\n",
+	 * or "error <length>\n<message>\n" for an operation that failed,
+	 * which does not stop the rest of the batch. The caller holds the
+	 * session's write mark throughout, as wait_write takes it. */
+	void run_batch(const ClientID& cid, const string& body,
+		       string* output) {
+		int state;
+		if (!_sessions.touch(cid, sensible_time::runtime(), &state)) {
+			Logger::error("run_batch(): % not client", cid);
+			throw "unknown client";
+		}
+		string prefix = "/" + to_string(cid) + "/";
+		size_t pos = 0;
+		while (pos < body.length()) {
+			size_t end = body.find('\n', pos);
+			if (end == string::npos) end = body.length();
+			string line = body.substr(pos, end - pos);
+			pos = end + 1;
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (line.empty()) continue;
+
+			map<string, string> query_args;
+			size_t query = line.find('?');
+			if (query != string::npos) {
+				parse_query(line.substr(query + 1), &query_args);
+				line.resize(query);
+			}
+			ArgumentViews args(RequestArena::get());
+			for (auto& x : query_args) args.emplace(x.first, x.second);
+			string url = prefix + line;
+			string result;
+			bool failed = false;
+			try {
+				ParsedUrl pieces;
+				if (!pieces.parse(url) ||
+				    serve(pieces, args, &state, &result) < 0) {
+					throw "invalid request";
+				}
+			} catch (string s) {
+				result = s;
+				failed = true;
+			} catch (const char* s) {
+				result = s;
+				failed = true;
+			}
+			*output += failed ? "error " : "ok ";
+			*output += to_string(result.length());
+			*output += '\n';
+			*output += result;
+			*output += '\n';
+		}
+		/* the last command's page is not what is being sent */
+		reply_page().reset();
+	}
+
+	/* AsyncViews holds the views passed to an _async backend method in
+	 * heap containers, since the backend may keep them until it calls
+	 * done, after the next request on this thread has reset the arena.
+	 * What they point into is the request's, which lasts until then.
+	 * since__ is the webserver's, and is left out of the arguments. */
+	struct AsyncViews {
+		AsyncViews(const ArgumentViews& args)
+			: parameters(pmr::new_delete_resource()),
+			  arguments(pmr::new_delete_resource()) {
+			for (auto& x : args) {
+				if (x.first != FRAGMENT_SINCE_ARG)
+					arguments.insert(x);
+			}
+		}
+
+		ParameterViews parameters;
+		ArgumentViews arguments;
+	};
+
+	/* geturl_async: starts get, resource, command and call requests
+	 * through the backend's _async methods; reply is completed when the
+	 * output is ready. For a route that writes, turn holds the session's
+	 * write mark, and releases it when the command is done. Returns false
+	 * for requests that geturl must serve synchronously. */
+	bool geturl_async(const ParsedUrl& pieces, const ArgumentViews& args,
+			  shared_ptr<AsyncReply> reply,
+			  shared_ptr<SessionTurn> turn) {
+		Route route = pieces.route();
+		if (pieces.size() < 3) return false;
+		if (route != ROUTE_GET && route != ROUTE_RESOURCE &&
+		    route != ROUTE_COMMAND && route != ROUTE_CALL) return false;
+		if (pieces[2] == "for_a_node") return false;
+
+		ClientID cid = pieces.cid();
+		int state;
+		if (!_sessions.touch(cid, sensible_time::runtime(), &state)) {
+			Logger::error("geturl_async(): % not client", cid);
+			throw "unknown client";
+		}
+
+		/* the views outlive this call, and the arena, until done */
+		shared_ptr<AsyncViews> views(new AsyncViews(args));
+		auto write = [reply, views](const string& output) {
+			*reply->output() = output;
+			reply->complete();
+		};
+		if (route == ROUTE_GET) {
+			pieces.arguments(3, &views->parameters);
+			BackendTimer timer(&_metrics, BACKEND_GET_VALUE);
+			_backend->get_value_async(cid, state, pieces[2],
+						  views->parameters,
+						  views->arguments, write);
+		} else if (route == ROUTE_RESOURCE) {
+			ResourceID rid = 0;
+			from_chars(pieces[2].data(),
+				   pieces[2].data() + pieces[2].length(), rid);
+			string ject = "";
+			if (pieces.size() == 4) ject = pieces[3];
+			BackendTimer timer(&_metrics, BACKEND_GET_RESOURCE);
+			_backend->get_resource_async(cid, rid, ject, write);
+		} else {
+			bool call = route == ROUTE_CALL;
+			uint64_t since;
+			bool patch = FragmentPatch::since(args, &since);
+			pieces.arguments(3, &views->parameters);
+			BackendTimer timer(&_metrics, BACKEND_RUN_COMMAND);
+			_backend->run_command_async(
+				cid, state, pieces[2], views->parameters,
+				views->arguments,
+				/* turn is held until the command's done, on
+				 * whichever thread */
+				[this, reply, cid, call, patch, since, turn,
+				 views](int new_state) {
+					_sessions.set_state(cid, new_state);
+					save_blob(cid, new_state);
+					if (!call) {
+						finish_command(
+							cid, new_state, reply.get(),
+							patch ? &since : nullptr);
+					}
+					turn->release();
+					reply->complete();
+				});
+		}
+		return true;
+	}
+
+	bool can_suspend() const {
+		return _can_suspend;
+	}
+
+	/* wait_write: takes the session's write mark into *turn for a
+	 * request that changes it. Returns true once the mark is held.
+	 * Otherwise the request is queued behind the one changing the
+	 * session and its connection suspended until end_write hands the
+	 * mark over; the handler should return MHD_YES, and is called again
+	 * with *turn held. In thread-per-connection mode this waits. */
+	bool wait_write(struct MHD_Connection* connection, const ClientID& cid,
+			shared_ptr<SessionTurn>* turn) {
+		shared_ptr<AsyncReply> handed(
+			new AsyncReply(connection, _can_suspend));
+		*turn = SessionTurn::take(&_sessions, cid, [handed]() {
+			handed->complete();
+		});
+		return (*turn)->held() || handed->ready_or_suspend();
+	}
+
+	/* parse_query: splits key=value&... into args, unescaping both. */
+	static void parse_query(string query, map<string, string>* args) {
+		size_t pos = 0;
+		while (pos <= query.length()) {
+			size_t end = query.find('&', pos);
+			if (end == string::npos) end = query.length();
+			string pair = query.substr(pos, end - pos);
+			pos = end + 1;
+			if (pair.empty()) continue;
+			size_t eq = pair.find('=');
+			string key = pair.substr(0, eq);
+			string value = eq == string::npos ? "" : pair.substr(eq + 1);
+			key.resize(MHD_http_unescape(&key[0]));
+			value.resize(MHD_http_unescape(&value[0]));
+			(*args)[key] = value;
+		}
+	}
+
+	/* admit: takes a token from the client address's request bucket. */
+	bool admit(struct MHD_Connection* connection) {
+		return !_request_limiter.enabled() ||
+			acquire(&_request_limiter, connection);
+	}
+
+	/* admit_session: takes a token from the address's session bucket. */
+	bool admit_session(struct MHD_Connection* connection) {
+		return !_session_limiter.enabled() ||
+			acquire(&_session_limiter, connection);
+	}
+
+	/* reject: the shared 429 reply to a request refused by admission. */
+	int reject(struct MHD_Connection* connection) {
+		_metrics.rejected();
+		if (_access_log.enabled()) {
+			_access_log.event("rejected", 0, 0,
+					  client_sockaddr(connection));
+		}
+		return MHD_queue_response(connection,
+					  MHD_HTTP_TOO_MANY_REQUESTS, _rejected);
+	}
+
+	/* upgrade_socket: answers a WebSocket handshake on /cid/socket. The
+	 * socket is then owned by _sockets and bound to the session. Only
+	 * version 13, RFC 6455, is spoken; other versions are told so with
+	 * 426 Upgrade Required. */
+	int upgrade_socket(struct MHD_Connection* connection,
+			   const ClientID& cid) {
+		const char* upgrade = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+		const char* connection_header = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONNECTION);
+		const char* key = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND, "Sec-WebSocket-Key");
+		const char* version = MHD_lookup_connection_value(
+			connection, MHD_HEADER_KIND, "Sec-WebSocket-Version");
+		if (!_sessions.touch(cid, sensible_time::runtime())) {
+			return send_page(connection, "unknown client",
+					 MHD_HTTP_NOT_FOUND);
+		}
+		if (!upgrade || !key || strcasecmp(upgrade, "websocket") ||
+		    !has_token(connection_header, "upgrade")) {
+			return send_page(connection, "expected a websocket",
+					 MHD_HTTP_BAD_REQUEST);
+		}
+		if (!version || strcmp(version, "13")) {
+			struct MHD_Response* response =
+				MHD_create_response_from_buffer(
+					0, (void *) "", MHD_RESPMEM_PERSISTENT);
+			MHD_add_response_header(response,
+						"Sec-WebSocket-Version", "13");
+			AccessLog::reply(MHD_HTTP_UPGRADE_REQUIRED);
+			int ret = MHD_queue_response(
+				connection, MHD_HTTP_UPGRADE_REQUIRED, response);
+			MHD_destroy_response(response);
+			return ret;
+		}
+		struct MHD_Response* response = MHD_create_response_for_upgrade(
+			&upgrade_socket_cb, (void *) new pair<WebServer*, ClientID>(this, cid));
+		MHD_add_response_header(response, MHD_HTTP_HEADER_UPGRADE,
+					"websocket");
+		MHD_add_response_header(response, "Sec-WebSocket-Accept",
+					WebSocketCodec::accept_key(key).c_str());
+		AccessLog::reply(MHD_HTTP_SWITCHING_PROTOCOLS);
+		int ret = MHD_queue_response(
+			connection, MHD_HTTP_SWITCHING_PROTOCOLS, response);
+		MHD_destroy_response(response);
+		return ret;
+	}
+
+	void adopt_socket(const ClientID& cid, int sock, const char* extra,
+			  size_t extra_size,
+			  struct MHD_UpgradeResponseHandle* urh) {
+		_sockets.add(cid, sock, extra, extra_size, urh);
+	}
+
+	/* push: sends a message to the client's sockets. */
+	virtual void push(const ClientID& cid, const string& message) {
+		_sockets.push(cid, message);
+	}
+
+	/* socket_message: serves a request frame of the form "tag path",
+	 * where path is what would follow /cid/ in a url, such as
+	 * command/next or get/key/a. The reply is "tag output", or
+	 * "tag !error" if the request failed. Pushes arrive as "! message".
+	 */
+	string socket_message(const ClientID& cid, const string& message) {
+		RequestArena::reset();
+		size_t space = message.find(' ');
+		string tag = message.substr(0, space);
+		string url = "/" + to_string(cid) + "/";
+		if (space != string::npos) url += message.substr(space + 1);
+		string output;
+		try {
+			ParsedUrl pieces;
+			if (!pieces.parse(url) || pieces.route() == ROUTE_SOCKET)
+				throw "invalid request";
+			if (geturl(pieces, ArgumentViews(), &output) < 0)
+				throw "invalid request";
+		} catch (string s) {
+			return tag + " !" + s;
+		} catch (const char* s) {
+			return tag + " !" + s;
+		}
+		return tag + " " + output;
+	}
+
+	/* has_token: whether a comma separated header value, such as
+	 * Connection: keep-alive, Upgrade, lists token, in any case. */
+	static bool has_token(const char* header, const char* token) {
+		if (!header) return false;
+		size_t length = strlen(token);
+		const char* p = header;
+		while (*p) {
+			while (*p == ' ' || *p == '\t' || *p == ',') ++p;
+			const char* end = p;
+			while (*end && *end != ',') ++end;
+			const char* last = end;
+			while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+				--last;
+			if ((size_t) (last - p) == length &&
+			    !strncasecmp(p, token, length)) {
+				return true;
+			}
+			p = end;
+		}
+		return false;
 	}
 
 	virtual void build_redirect(string* output) const {
@@ -293,11 +1084,93 @@ public:
 	}
 
 protected:
+	/* build_output: renders the client's page, or copies the cached
+	 * render if the backend's page_version has not moved since. The
+	 * version is read before rendering, so a change made during the
+	 * render only causes a second render. */
 	virtual void build_output(const ClientID& cid, string* output) {
-		_backend->get_page(cid, _state[cid], output);
+		int state = _sessions.state(cid);
+		uint64_t version = 0;
+		if (_render_cache.enabled()) {
+			BackendTimer timer(&_metrics, BACKEND_PAGE_VERSION);
+			version = _backend->page_version(cid, state);
+		}
+		if (version) {
+			shared_ptr<CachedPage> page =
+				_render_cache.get(cid, state, version);
+			if (page) {
+				output->append(page->data);
+				security_checks(cid, output);
+				reply_page() = page;
+				return;
+			}
+		}
+		OutputSink sink(output);
+		{
+			BackendTimer timer(&_metrics, BACKEND_GET_PAGE);
+			_backend->get_page(cid, state, &sink);
+		}
+		if (version) {
+			reply_page() = _render_cache.put(cid, state, version,
+							 *output);
+		}
 		security_checks(cid, output);
 	}
 
+	/* without_since: the arguments for the backend, which are args
+	 * unless they hold since__; then they are copied to stripped without
+	 * it. */
+	static const ArgumentViews& without_since(const ArgumentViews& args,
+						  ArgumentViews* stripped) {
+		if (!args.count(FRAGMENT_SINCE_ARG)) return args;
+		for (auto& x : args) {
+			if (x.first != FRAGMENT_SINCE_ARG) stripped->insert(x);
+		}
+		return *stripped;
+	}
+
+	/* build_patch: writes the FragmentPatch of what changed since the
+	 * version the client sent in since__, if the backend can say.
+	 * Otherwise returns false with output untouched, for build_output to
+	 * send the whole page. */
+	bool build_patch(const ClientID& cid, int state, uint64_t since,
+			 string* output) {
+		uint64_t version = 0;
+		vector<Fragment> fragments;
+		{
+			BackendTimer timer(&_metrics, BACKEND_GET_FRAGMENTS);
+			if (!_backend->get_fragments(cid, state, since, &version,
+						     &fragments)) {
+				return false;
+			}
+		}
+		FragmentPatch::write(version, fragments, output);
+		return true;
+	}
+
+	/* finish_command: renders the page, or the patch since the version
+	 * in since, after an asynchronous command. It may run on a backend
+	 * thread, where nothing catches. */
+	void finish_command(const ClientID& cid, int state, AsyncReply* reply,
+			    const uint64_t* since) {
+		try {
+			if (!since || !build_patch(cid, state, *since,
+						   reply->output())) {
+				build_output(cid, reply->output());
+			}
+		} catch (...) {
+			Logger::error("(webserver) render after command for % "
+				      "failed", cid);
+			reply->output()->clear();
+			build_redirect(reply->output());
+		}
+	}
+
+	/* invalidate_page: drops the cached render for the client. */
+	void invalidate_page(const ClientID& cid) {
+		_render_cache.erase(cid);
+	}
+
 	virtual void security_checks(const ClientID& cid, string* output) {
 		stringstream ss;
 		/* todo: perhaps bulid this list by querying the root abstract
@@ -307,117 +1180,266 @@ protected:
 		 */
 	}
 
-	bool is_client(const ClientID& cid) const {
-		return _state.count(cid);
+	static bool acquire(RateLimiter* limiter,
+			    struct MHD_Connection* connection) {
+		uint64_t key;
+		if (!RateLimiter::address_key(client_sockaddr(connection), &key))
+			return true;
+		return limiter->acquire(key);
 	}
 
+	/* sent: counts bytes sent for a reply. */
+	void sent(size_t bytes) {
+		_metrics.sent(bytes);
+		AccessLog::sent(bytes);
+	}
+
+	bool is_client(const ClientID& cid) {
+		return _sessions.exists(cid);
+	}
+
+	/* new_session: registers a fresh client. The backend is told about
+	 * the client before the cid is returned, but outside of any lock. At
+	 * max_sessions, room is made before the session is created, so the
+	 * new one is never among those shed. */
 	ClientID new_session() {
+		vector<ClientID> shed;
+		size_t size = _sessions.size();
+		if (_max_sessions && size >= _max_sessions)
+			_sessions.shed(size + 1 - _max_sessions, &shed);
 		ClientID cid;
 		do {
-			cid = entropy::_<uint64_t>();
-		} while (_clients.count(cid));
-		_clients.insert(cid);
-		_backend->new_client(cid);
-		// TODO: rate limting
+			cid = _proxy.tag(entropy::_<uint64_t>());
+		} while (!_sessions.create(cid, sensible_time::runtime()));
+		if (!shed.empty()) {
+			_access_log.event("shed", cid, shed.size());
+			bye_clients(shed);
+		}
+		{
+			BackendTimer timer(&_metrics, BACKEND_NEW_CLIENT);
+			_backend->new_client(cid);
+		}
+		save_blob(cid, 0);
 		return cid;
 	}
 
-	void split_url(const string& url, vector<string> *pieces) const {
-		assert(pieces);
-                size_t len = url.length();
-                char* buf = (char *) malloc(sizeof(char) * len);
-                strncpy(buf, url.c_str() + 1, len - 1);
-                buf[len - 1] = 0;
+	/* start_local_daemon: serves the unix socket that other workers
+	 * forward this worker's requests to, with the same options as the
+	 * public port. */
+	void start_local_daemon(unsigned int flags,
+				vector<MHD_OptionItem>* options) {
+		int fd = _proxy.listen_local();
+		if (fd < 0) {
+			Logger::error("(worker) % cannot take forwarded "
+				      "requests", _worker_index);
+			return;
+		}
+		options->push_back({MHD_OPTION_LISTEN_SOCKET, fd, nullptr});
+		options->push_back({MHD_OPTION_END, 0, nullptr});
+		_local_daemon = MHD_start_daemon(
+			flags, 0, nullptr, nullptr, &http_serv, (void *) this,
+			MHD_OPTION_ARRAY, options->data(), MHD_OPTION_END);
+		if (!_local_daemon) {
+			Logger::error("(worker) cannot serve %",
+				      _proxy.socket_path(_worker_index));
+			close(fd);
+		}
+	}
+
+	/* restore_sessions: reloads the sessions saved by the previous run
+	 * and hands each to the backend's restore_client, before any request
+	 * is served. */
+	void restore_sessions(size_t slots) {
+		vector<SnapshotRecord> restored;
+		string path = _snapshot_path;
+		if (_proxy.enabled()) path += "." + to_string(_worker_index);
+		if (!_sessions.open_snapshot(path, slots,
+					     sensible_time::runtime(),
+					     &restored)) {
+			Logger::error("(snapshot) sessions will not be saved");
+			return;
+		}
+		for (auto& x : restored) {
+			_backend->restore_client(
+				x.cid, x.state, string(x.blob, x.blob_length));
+		}
+		Logger::info("(snapshot) restored % sessions from %",
+			     restored.size(), path);
+	}
+
+	/* save_blob: stores the backend's session_blob in the snapshot. */
+	void save_blob(const ClientID& cid, int state) {
+		if (!_sessions.snapshot_enabled()) return;
+		if (!_sessions.set_blob(cid, _backend->session_blob(cid, state))) {
+			Logger::error("(snapshot) blob for % over % bytes",
+				      cid, SESSION_SNAPSHOT_BLOB_BYTES);
+		}
+	}
 
-                char *p = strtok(buf, "/");
-                while (p) {
-			if (strlen(p)) pieces->push_back(string(p));
-                        p = strtok(NULL, "/");
-                }
-                free(buf);
-        }
+	static int config_or(const string& key, int value) {
+		int retval = Config::_()->get(key);
+		return retval > 0 ? retval : value;
+	}
 
 	void client_alive(const ClientID& cid) {
-		_last_active[cid] = sensible_time::runtime();
+		_sessions.touch(cid, sensible_time::runtime());
 	}
 
+	/* housekeeping_thread: every housekeeping_timeout_ms, expires the
+	 * sessions idle for over life_period seconds as one batch and says
+	 * goodbye to them after the session locks are released. */
 	void housekeeping_thread() {
 		chrono::milliseconds
 			milliseconds(Config::_()->get("housekeeping_timeout_ms"));
-		int tidy_period = Config::_()->get("tidy_period");
-		int life_period = Config::_()->get("life_period");
-		int last_tidied = sensible_time::runtime();
-		set<ClientID> evict_list;
+		vector<ClientID> evict_list;
 
 		while (_alive) {
 			this_thread::sleep_for(milliseconds);
-			unique_lock<mutex> ul(_mutex);
+			evict_list.clear();
+			_sessions.flush_snapshot(false);
+			_sessions.expire(sensible_time::runtime(), &evict_list);
+			if (evict_list.empty()) continue;
+			Logger::info("(housekeeping) evicting % idle clients.",
+				     evict_list.size());
+			bye_clients(evict_list);
+		}
+	}
 
-			if (sensible_time::runtime() - last_tidied > tidy_period) {
-				last_tidied = sensible_time::runtime();
-				for (auto &x : _last_active) {
-					if (sensible_time::runtime() - x.second
-					    > life_period) {
-						Logger::info("(housekeeping) "
-							     "I'm done with %, "
-							     "been idle for % "
-							     "seconds.",
-							     x.first,
-							     sensible_time::runtime()
-							     - x.second);
-						evict_list.insert(x.first);
-					}
-				}
-				continue;
-			}
-			if (!evict_list.empty()) {
-				evict_client(*evict_list.begin());
-				evict_list.erase(*evict_list.begin());
-			}
+	/* bye_clients: tells the backend about clients whose sessions have
+	 * already been removed. */
+	virtual void bye_clients(const vector<ClientID>& cids) {
+		_metrics.evicted(cids.size());
+		for (auto& x : cids) {
+			_access_log.event("bye", x, 0);
+			_render_cache.erase(x);
+			_sockets.close_client(x);
+			BackendTimer timer(&_metrics, BACKEND_BYE_CLIENT);
+			_backend->bye_client(x);
 		}
 	}
 
 	virtual void evict_client(const ClientID& cid) {
-		Logger::info("(housekeeping) byebye %", cid);
+		if (!_sessions.erase(cid)) return;
+		_access_log.event("bye", cid, 0);
+		_render_cache.erase(cid);
+		_sockets.close_client(cid);
+		_metrics.evicted(1);
+		BackendTimer timer(&_metrics, BACKEND_BYE_CLIENT);
 		_backend->bye_client(cid);
-		_state.erase(cid);
-		_last_active.erase(cid);
-		_clients.erase(cid);
-		_possible_commands.erase(cid);
-		_possible_resources.erase(cid);
 	}
 
+	/* _mutex only guards the server lifecycle; per-client state lives in
+	 * _sessions and is locked per shard. */
 	mutex _mutex;
-	set<ClientID> _clients;
 	unique_ptr<thread> _housekeeping_thread;
-	bool _alive;
+	atomic<bool> _alive;
 
 	IWebserverBackend* _backend;
 	struct MHD_Daemon * _daemon;
-	map<ClientID, int> _state;
-	map<ClientID, int> _last_active;
+	bool _can_suspend;
+	size_t _post_buffer_size;
+	bool _upload_spill;
+	string _upload_spill_dir;
+	string _snapshot_path;
+	WorkerProxy _proxy;
+	struct MHD_Daemon* _local_daemon;
+	int _worker_index;
+	int _worker_count;
+	SessionStore _sessions;
+	StaticFiles _static_files;
+	RenderCache _render_cache;
+	Compression _compression;
+	WebSocketHub _sockets;
+	Metrics _metrics;
+	bool _metrics_enabled;
+	size_t _max_sessions;
+	RateLimiter _session_limiter;
+	RateLimiter _request_limiter;
+	struct MHD_Response* _rejected;
+	struct MHD_Response* _patch_script;
+	AccessLog _access_log;
+	string _access_log_path;
+};
+
+/* RouteTimer files the time from its creation, or from start if that is
+ * set later, to its destruction under route, unless route was left at
+ * METRIC_ROUTES, and then hands the request to the access log. http_serv
+ * sets route only on the call that replies. */
+struct RouteTimer {
+	RouteTimer(Metrics* m, AccessLog* l, struct MHD_Connection* c,
+		   const char* request_method, const char* request_url)
+		: metrics(m), log(l), connection(c), method(request_method),
+		  url(request_url), route(METRIC_ROUTES),
+		  start(Metrics::now()) {
+		AccessLog::begin();
+	}
+
+	~RouteTimer() {
+		if (route == METRIC_ROUTES) return;
+		metrics->route(route, start);
+		if (log->enabled()) {
+			log->request(WebServer::client_sockaddr(connection),
+				     method, url, start, Metrics::now());
+		}
+	}
 
-	map<ClientID, set<string>> _possible_commands;
-	map<ClientID, set<string>> _possible_resources;
+	Metrics* metrics;
+	AccessLog* log;
+	struct MHD_Connection* connection;
+	const char* method;
+	const char* url;
+	MetricRoute route;
+	uint64_t start;
 };
 
 struct connection_info_struct
 {
-	string answer;
-	string url;
+	connection_info_struct()
+		: post_processor(nullptr), finished(false),
+		  route(METRIC_ROUTES), start(Metrics::now()) {}
+
 	struct MHD_PostProcessor *post_processor;
-	WebServer* webserver;
+	unique_ptr<IUploadSink> sink;
+
+	/* set for a request forwarded to the worker owning its session */
+	shared_ptr<ProxyRequest> proxy;
+	bool finished;
+
+	/* set for a suspended GET waiting on the backend */
+	shared_ptr<AsyncReply> reply;
+
+	/* the session's write mark, for a request that changes the session,
+	 * once taken with wait_write */
+	shared_ptr<SessionTurn> turn;
+
+	/* the body of a POST to /cid/batch, which has no sink */
+	string batch;
+
+	/* what to time the request under, and from when */
+	MetricRoute route;
+	uint64_t start;
 };
 
+/* GET requests park this marker in the connection context between the
+ * header and body callbacks. It is not a connection_info_struct. */
+static int get_marker;
+
 static void request_completed(void* cls,
 			      struct MHD_Connection *connection,
 			      void **con_cls,
 			      enum MHD_RequestTerminationCode toe) {
+	if (*con_cls == &get_marker) {
+		*con_cls = nullptr;
+		return;
+	}
 	struct connection_info_struct* con_info =
 		(struct connection_info_struct *) *con_cls;
 	if (!con_info) return;
-	MHD_destroy_post_processor(con_info->post_processor);
-	free(con_info);
+	if (con_info->post_processor)
+		MHD_destroy_post_processor(con_info->post_processor);
+	if (con_info->sink && !con_info->finished) con_info->sink->abort();
+	if (con_info->proxy) con_info->proxy->abandon();
+	delete con_info;
 	*con_cls = nullptr;
 }
 
@@ -428,32 +1450,47 @@ static int iterate_post(
 		size_t size) {
 	struct connection_info_struct* con_info =
 		(struct connection_info_struct*) coninfo_cls;
-	Logger::info("iterate post: % % off % len %", key,
-		     filename ? filename : "", off, size);
-	return con_info->webserver->recv_post(
-		con_info->url, key ? key : "", filename ? filename : "",
+	bool ok = con_info->sink->write(
+		key ? key : "", filename ? filename : "",
 		content_type ? content_type : "",
 		transfer_encoding ? transfer_encoding : "",
-		data ? string(data, size) : "", off, size, &(con_info->answer));
+		data ? string_view(data, size) : string_view(), off);
+	return ok ? MHD_YES : MHD_NO;
 }
 
 static int send_page(struct MHD_Connection *connection,
-		     const string& output) {
+		     const string& output,
+		     unsigned int status) {
 	struct MHD_Response* response = MHD_create_response_from_buffer(
 		output.length(),
 		(void *) output.c_str(),
 		MHD_RESPMEM_MUST_COPY);
-	int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	AccessLog::reply(status);
+	int ret = MHD_queue_response(connection, status, response);
 	MHD_destroy_response(response);
-	//Logger::info("(webserver) reply length %", output.length());
 	return ret;
 }
 
-static int add_map_cb(void *cls,
+static void upgrade_socket_cb(void* cls,
+			      struct MHD_Connection* connection,
+			      void* con_cls,
+			      const char* extra_in,
+			      size_t extra_in_size,
+			      int sock,
+			      struct MHD_UpgradeResponseHandle* urh) {
+	unique_ptr<pair<WebServer*, ClientID>> socket_owner(
+		static_cast<pair<WebServer*, ClientID>*>(cls));
+	socket_owner->first->adopt_socket(socket_owner->second, sock,
+					  extra_in, extra_in_size, urh);
+}
+
+/* add_view_cb: adds a query argument as views into the request, which
+ * microhttpd keeps until the request completes. */
+static int add_view_cb(void *cls,
 		       enum MHD_ValueKind kind,
 		       const char *key, const char *value) {
-	map<string, string>* m = reinterpret_cast<map<string, string>*>(cls);
-	(*m)[string(key)] = string(value);
+	ArgumentViews* m = reinterpret_cast<ArgumentViews*>(cls);
+	(*m)[key] = value ? string_view(value) : string_view();
 	return MHD_YES;
 }
 
@@ -465,63 +1502,159 @@ static int http_serv(void * cls,
                      const char * upload_data,
                      size_t * upload_data_size,
                      void ** ptr) {
-	string output;
+	string& output = *OutputSink::scratch();
+	RequestArena::reset();
 	WebServer* webserver = static_cast<WebServer*>(cls);
+	WebServer::reply_page().reset();
+	RouteTimer timer(webserver->metrics(), webserver->access_log(),
+			 connection, method, url);
 	if (!webserver->log_connection(connection, url, method, &output)) {
-		return send_page(connection, output);
+		return webserver->send_output(connection, output);
 	}
 	if (string(url) == "/favicon.ico") return MHD_NO;
 
 	try {
 
+	if (!*ptr && !webserver->admit(connection)) {
+		return webserver->reject(connection);
+	}
 	if (strncmp("/raw__", url, 6) == 0) {
-		webserver->raw_url(url + 1, &output);
-		return send_page(connection, output);
+		timer.route = METRIC_RAW;
+		return webserver->raw_url(connection, url + 1);
 	}
-	if (webserver->early_abort(url, &output)) {
-		return send_page(connection, output);
+	if (strcmp("/metrics__", url) == 0) {
+		return webserver->metrics_url(connection);
+	}
+	ParsedUrl pieces;
+	if (!pieces.parse(url)) throw "invalid request";
+	if (webserver->foreign(pieces, connection)) {
+		if (!*ptr) {
+			if (pieces.route() == ROUTE_SOCKET) {
+				/* an upgraded socket cannot be relayed; the
+				 * client retries and may land on the owner */
+				return send_page(connection,
+						 "wrong worker for websocket",
+						 MHD_HTTP_MISDIRECTED_REQUEST);
+			}
+			unique_ptr<struct connection_info_struct> con_info(
+				new struct connection_info_struct());
+			con_info->proxy = webserver->open_proxy(
+				connection, pieces, method, url);
+			if (!con_info->proxy) return MHD_NO;
+			*ptr = (void *) con_info.release();
+			return MHD_YES;
+		}
+		struct connection_info_struct *con_info =
+			static_cast<struct connection_info_struct *>(*ptr);
+		if (*upload_data_size) {
+			/* a piece the worker cannot take yet is passed again
+			 * once the connection is resumed */
+			bool taken;
+			if (!con_info->proxy->body(upload_data,
+						   *upload_data_size, &taken)) {
+				return MHD_NO;
+			}
+			if (taken) *upload_data_size = 0;
+			return MHD_YES;
+		}
+		return con_info->proxy->finish();
+	}
+	if (!*ptr && pieces.route() == ROUTE_NEW_SESSION &&
+	    !webserver->admit_session(connection)) {
+		return webserver->reject(connection);
+	}
+	if (webserver->early_abort(pieces, &output)) {
+		timer.route = WebServer::metric_route(pieces);
+		return webserver->send_output(connection, output);
 	}
 
-	if (string(method) == "POST") {
-		if (!*ptr) {  // new post connection
-			struct connection_info_struct *con_info =
-				new struct connection_info_struct();
-			if (!con_info) return MHD_NO;
-			con_info->webserver = webserver;
-			con_info->post_processor =
-				MHD_create_post_processor(connection,
-							  POST_BUFFER_SIZE,
-							  iterate_post,
-							  (void *) con_info);
-			if (!con_info->post_processor) {
-				delete con_info;
+	if (string(method) == "POST" && pieces.route() == ROUTE_BATCH) {
+		if (!*ptr) {
+			*ptr = (void *) new struct connection_info_struct();
+			return MHD_YES;
+		}
+		struct connection_info_struct *con_info =
+			static_cast<struct connection_info_struct *>(*ptr);
+		if (*upload_data_size != 0) {
+			if (con_info->batch.length() + *upload_data_size >
+			    BATCH_MAX_BYTES) {
+				Logger::error("batch for % over % bytes",
+					      url, BATCH_MAX_BYTES);
 				return MHD_NO;
 			}
+			con_info->batch.append(upload_data, *upload_data_size);
+			*upload_data_size = 0;
+			return MHD_YES;
+		}
+		if (!con_info->turn &&
+		    !webserver->wait_write(connection, pieces.cid(),
+					   &con_info->turn)) {
+			return MHD_YES;
+		}
+		timer.route = METRIC_BATCH;
+		timer.start = con_info->start;
+		webserver->run_batch(pieces.cid(), con_info->batch, &output);
+		con_info->turn->release();
+		return webserver->send_output(connection, output);
+	}
+
+	if (string(method) == "POST") {
+		if (!*ptr) {  // new post connection
 			if (*upload_data_size) {
 				Logger::error("for % had upload %",
 					      url,
 					      *upload_data_size);
 				throw "invalid argument";
 			}
-			*ptr = (void *) con_info;
+			unique_ptr<struct connection_info_struct> con_info(
+				new struct connection_info_struct());
+			con_info->sink.reset(webserver->open_upload(pieces));
+			if (!con_info->sink) return MHD_NO;
+			con_info->post_processor =
+				MHD_create_post_processor(
+					connection,
+					webserver->post_buffer_size(),
+					iterate_post,
+					(void *) con_info.get());
+			if (!con_info->post_processor) return MHD_NO;
+			*ptr = (void *) con_info.release();
 			return MHD_YES;
 		}
 
 		struct connection_info_struct *con_info =
 			static_cast<struct connection_info_struct *>(*ptr);
 		if (*upload_data_size != 0) {
-			con_info->url = url;
-			MHD_post_process(con_info->post_processor,
-					 upload_data,
-					 *upload_data_size);
+			int ret = MHD_post_process(con_info->post_processor,
+						   upload_data,
+						   *upload_data_size);
 			*upload_data_size = 0;
+			if (ret != MHD_YES) return MHD_NO;
 		} else {
-			webserver->recv_post(url, "", "", "", "", "", 0, 0,
-					     nullptr);
+			timer.route = METRIC_POST;
+			timer.start = con_info->start;
+			if (!con_info->finished) {
+				con_info->finished = true;
+				con_info->sink->finish();
+				if (con_info->sink->failed()) {
+					Logger::error("upload for % failed; "
+						      "command not run", url);
+					return send_page(
+						connection, "upload failed",
+						MHD_HTTP_INTERNAL_SERVER_ERROR);
+				}
+			}
+			/* called again here once resumed with the mark */
+			bool writes = WebServer::writes(pieces.route());
+			if (writes && !con_info->turn &&
+			    !webserver->wait_write(connection, pieces.cid(),
+						   &con_info->turn)) {
+				timer.route = METRIC_ROUTES;
+				return MHD_YES;
+			}
 			/* HERE: run the post command, get the url */
-			string output;
-			webserver->geturl(string(url), map<string, string>(), &output);
-			return send_page(connection, output);
+			webserver->geturl(pieces, ArgumentViews(), &output, writes);
+			if (con_info->turn) con_info->turn->release();
+			return webserver->send_output(connection, output);
 
 		}
 		//
@@ -533,30 +1666,91 @@ static int http_serv(void * cls,
 
 	if (string(method) != "GET") return MHD_NO;
 
-	static int dummy;
-	if (&dummy != *ptr) {
-		*ptr = &dummy;
-		return MHD_YES;
+	/* the session's write mark, if the request changes the session */
+	shared_ptr<SessionTurn> turn;
+	if (*ptr && *ptr != &get_marker) {
+		struct connection_info_struct *con_info =
+			static_cast<struct connection_info_struct *>(*ptr);
+		if (con_info->reply) {  // resumed after the backend
+			assert(con_info->reply->ready());
+			timer.route = con_info->route;
+			timer.start = con_info->start;
+			output.swap(*con_info->reply->output());
+			return webserver->send_output(connection, output);
+		}
+		/* resumed with the write mark handed over */
+		assert(con_info->turn && con_info->turn->held());
+		turn = move(con_info->turn);
+		timer.start = con_info->start;
+		delete con_info;
+		*ptr = nullptr;
+	} else {
+		if (&get_marker != *ptr) {
+			*ptr = &get_marker;
+			return MHD_YES;
+		}
+		if (*upload_data_size) return MHD_NO;
+		*ptr = nullptr;
 	}
-	if (*upload_data_size) return MHD_NO;
-	*ptr = nullptr;
 
 	// TODO: pass useful information from connection
 
-	map<string, string> args;
+	ArgumentViews args(RequestArena::get());
 	MHD_get_connection_values(
 		connection,
 		MHD_GET_ARGUMENT_KIND,
-		&add_map_cb,
+		&add_view_cb,
 		&args);
 
-	webserver->geturl(string(url), args, &output);
-	return send_page(connection, output);
+	if (pieces.route() == ROUTE_SOCKET) {
+		return webserver->upgrade_socket(connection, pieces.cid());
+	}
+	int streamed;
+	if (webserver->stream_resource(connection, pieces, &streamed)) {
+		timer.route = METRIC_RESOURCE;
+		return streamed;
+	}
+
+	if (!turn && WebServer::writes(pieces.route()) &&
+	    !webserver->wait_write(connection, pieces.cid(), &turn)) {
+		struct connection_info_struct *con_info =
+			new struct connection_info_struct();
+		con_info->turn = turn;
+		con_info->start = timer.start;
+		*ptr = (void *) con_info;
+		return MHD_YES;
+	}
+	shared_ptr<AsyncReply> reply(
+		new AsyncReply(connection, webserver->can_suspend()));
+	if (webserver->geturl_async(pieces, args, reply, turn)) {
+		if (reply->ready_or_suspend()) {
+			timer.route = WebServer::metric_route(pieces);
+			output.swap(*reply->output());
+			return webserver->send_output(connection, output);
+		}
+		struct connection_info_struct *con_info =
+			new struct connection_info_struct();
+		con_info->reply = reply;
+		con_info->route = WebServer::metric_route(pieces);
+		con_info->start = timer.start;
+		*ptr = (void *) con_info;
+		return MHD_YES;
+	}
+
+	timer.route = WebServer::metric_route(pieces);
+	webserver->geturl(pieces, args, &output, turn != nullptr);
+	if (turn) turn->release();
+	return webserver->send_output(connection, output);
 
 	} catch (string s) {
 		Logger::error("(webserver) caught exception \"%\".", s);
 		webserver->build_redirect(&output);
-		return send_page(connection, output);
+		return webserver->send_output(connection, output);
+	} catch (const char* s) {
+		Logger::error("(webserver) caught exception \"%\".", s);
+		output.clear();
+		webserver->build_redirect(&output);
+		return webserver->send_output(connection, output);
 	}
 }
 
@@ -0,0 +1,575 @@
+#ifndef __CENTIPEDE__WEBSOCKET__H__
+#define __CENTIPEDE__WEBSOCKET__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <microhttpd.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/logger.h"
+#include "centipede/types.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_MAX_MESSAGE (1 << 20)
+#define WEBSOCKET_MAX_OUTBOUND (4 << 20)
+#define WEBSOCKET_MAX_PENDING 64
+#define WEBSOCKET_THREADS 2
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+/* WebSocketCodec has the pieces of RFC 6455 the server needs: the
+ * handshake accept key and text, pong and close frames. */
+class WebSocketCodec {
+public:
+	enum Opcode {
+		CONTINUATION = 0x0,
+		TEXT = 0x1,
+		BINARY = 0x2,
+		CLOSE = 0x8,
+		PING = 0x9,
+		PONG = 0xa,
+	};
+
+	/* accept_key: the Sec-WebSocket-Accept value for a client key. */
+	static string accept_key(const string& key) {
+		unsigned char digest[20];
+		sha1(key + WEBSOCKET_GUID, digest);
+		return base64(digest, sizeof(digest));
+	}
+
+	/* frame: appends an unmasked, unfragmented server frame. */
+	static void frame(Opcode opcode, const string& payload,
+			  string* output) {
+		output->push_back((char) (0x80 | opcode));
+		uint64_t len = payload.length();
+		if (len < 126) {
+			output->push_back((char) len);
+		} else if (len < 65536) {
+			output->push_back((char) 126);
+			output->push_back((char) (len >> 8));
+			output->push_back((char) len);
+		} else {
+			output->push_back((char) 127);
+			for (int i = 7; i >= 0; --i)
+				output->push_back((char) (len >> (8 * i)));
+		}
+		output->append(payload);
+	}
+
+	/* parse: reads one client frame from the front of data. Returns the
+	 * bytes consumed, 0 if the frame is incomplete, or -1 if it is
+	 * invalid or larger than WEBSOCKET_MAX_MESSAGE. */
+	static ssize_t parse(const string& data, bool* fin, Opcode* opcode,
+			     string* payload) {
+		const unsigned char* p = (const unsigned char*) data.data();
+		size_t have = data.length();
+		if (have < 2) return 0;
+		*fin = p[0] & 0x80;
+		*opcode = (Opcode) (p[0] & 0x0f);
+		if (!(p[1] & 0x80)) return -1;  // clients must mask
+		uint64_t len = p[1] & 0x7f;
+		size_t pos = 2;
+		if (len == 126) {
+			if (have < 4) return 0;
+			len = (p[2] << 8) | p[3];
+			pos = 4;
+		} else if (len == 127) {
+			if (have < 10) return 0;
+			len = 0;
+			for (int i = 0; i < 8; ++i) len = (len << 8) | p[2 + i];
+			pos = 10;
+		}
+		if (len > WEBSOCKET_MAX_MESSAGE) return -1;
+		if (have < pos + 4 + len) return 0;
+		const unsigned char* mask = p + pos;
+		pos += 4;
+		payload->resize(len);
+		for (uint64_t i = 0; i < len; ++i)
+			(*payload)[i] = p[pos + i] ^ mask[i % 4];
+		return pos + len;
+	}
+
+protected:
+	static uint32_t rotl(uint32_t x, int n) {
+		return (x << n) | (x >> (32 - n));
+	}
+
+	static void sha1(const string& input, unsigned char* digest) {
+		uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+				 0x10325476, 0xC3D2E1F0};
+		string msg = input;
+		uint64_t bits = (uint64_t) input.length() * 8;
+		msg.push_back((char) 0x80);
+		while (msg.length() % 64 != 56) msg.push_back(0);
+		for (int i = 7; i >= 0; --i) msg.push_back((char) (bits >> (8 * i)));
+
+		for (size_t chunk = 0; chunk < msg.length(); chunk += 64) {
+			uint32_t w[80];
+			const unsigned char* c =
+				(const unsigned char*) msg.data() + chunk;
+			for (int i = 0; i < 16; ++i) {
+				w[i] = (c[4 * i] << 24) | (c[4 * i + 1] << 16) |
+					(c[4 * i + 2] << 8) | c[4 * i + 3];
+			}
+			for (int i = 16; i < 80; ++i)
+				w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^
+					    w[i - 16], 1);
+			uint32_t a = h[0], b = h[1], cc = h[2], d = h[3], e = h[4];
+			for (int i = 0; i < 80; ++i) {
+				uint32_t f, k;
+				if (i < 20) {
+					f = (b & cc) | (~b & d);
+					k = 0x5A827999;
+				} else if (i < 40) {
+					f = b ^ cc ^ d;
+					k = 0x6ED9EBA1;
+				} else if (i < 60) {
+					f = (b & cc) | (b & d) | (cc & d);
+					k = 0x8F1BBCDC;
+				} else {
+					f = b ^ cc ^ d;
+					k = 0xCA62C1D6;
+				}
+				uint32_t t = rotl(a, 5) + f + e + k + w[i];
+				e = d;
+				d = cc;
+				cc = rotl(b, 30);
+				b = a;
+				a = t;
+			}
+			h[0] += a;
+			h[1] += b;
+			h[2] += cc;
+			h[3] += d;
+			h[4] += e;
+		}
+		for (int i = 0; i < 5; ++i) {
+			digest[4 * i] = h[i] >> 24;
+			digest[4 * i + 1] = h[i] >> 16;
+			digest[4 * i + 2] = h[i] >> 8;
+			digest[4 * i + 3] = h[i];
+		}
+	}
+
+	static string base64(const unsigned char* data, size_t length) {
+		static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			"abcdefghijklmnopqrstuvwxyz0123456789+/";
+		string output;
+		for (size_t i = 0; i < length; i += 3) {
+			uint32_t v = data[i] << 16;
+			if (i + 1 < length) v |= data[i + 1] << 8;
+			if (i + 2 < length) v |= data[i + 2];
+			output.push_back(table[(v >> 18) & 63]);
+			output.push_back(table[(v >> 12) & 63]);
+			output.push_back(i + 1 < length ? table[(v >> 6) & 63] : '=');
+			output.push_back(i + 2 < length ? table[v & 63] : '=');
+		}
+		return output;
+	}
+};
+
+/* WebSocketHub owns the upgraded sockets and reads them all from one
+ * epoll thread. Each socket belongs to a client session. Complete text
+ * messages are queued on their socket and handed to a small pool of
+ * handler threads, so that a slow request does not hold up the other
+ * sockets; a socket is served by one handler thread at a time, so its
+ * messages are still handled in order, and whatever the handler returns
+ * is sent back.
+ *
+ * Sends never block: a frame the socket cannot take at once is kept in
+ * the socket's outbound buffer, which the epoll thread drains when the
+ * socket is writable. A client that lets over WEBSOCKET_MAX_OUTBOUND
+ * bytes, or WEBSOCKET_MAX_PENDING messages, pile up is disconnected.
+ * push() may be called from any thread.
+ */
+class WebSocketHub {
+public:
+	typedef function<string(const ClientID&, const string&)> Handler;
+
+	WebSocketHub() : _epoll(-1), _alive(false) {}
+
+	~WebSocketHub() {
+		stop();
+	}
+
+	void start(Handler handler, int threads = WEBSOCKET_THREADS) {
+		_handler = handler;
+		_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (_epoll < 0) {
+			Logger::error("(websocket) epoll_create1 failed: %",
+				      strerror(errno));
+			return;
+		}
+		_alive = true;
+		_thread.reset(new thread(&WebSocketHub::loop, this));
+		for (int i = 0; i < max(threads, 1); ++i)
+			_handlers.emplace_back(&WebSocketHub::handle, this);
+	}
+
+	void stop() {
+		if (!_alive) return;
+		{
+			unique_lock<mutex> ul(_work_mutex);
+			_alive = false;
+		}
+		_work_ready.notify_all();
+		_thread->join();
+		for (auto& x : _handlers) x.join();
+		_handlers.clear();
+		unique_lock<mutex> ul(_mutex);
+		while (!_sockets.empty()) drop(_sockets.begin()->first);
+		close(_epoll);
+	}
+
+	/* add: takes over an upgraded connection. extra holds bytes microhttpd
+	 * had already read past the handshake. */
+	void add(const ClientID& cid, int sock, const char* extra,
+		 size_t extra_size, struct MHD_UpgradeResponseHandle* urh) {
+		shared_ptr<Socket> s(new Socket());
+		s->_cid = cid;
+		s->_sock = sock;
+		s->_urh = urh;
+		s->_closed = false;
+		s->_writable_wait = false;
+		s->_dispatched = false;
+		s->_in.assign(extra, extra_size);
+		unique_lock<mutex> read(s->_read);
+		unique_lock<mutex> ul(_mutex);
+		if (!_alive) {
+			MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+			return;
+		}
+		_sockets[sock] = s;
+		_clients[cid].insert(sock);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = sock;
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, sock, &ev);
+		ul.unlock();
+		if (!s->_in.empty() && !receive(s)) {
+			ul.lock();
+			drop(sock);
+		}
+	}
+
+	/* push: sends a text message to every socket of the client, or to
+	 * every socket if cid is CLIENT_ALL. */
+	void push(const ClientID& cid, const string& message) {
+		string frame;
+		WebSocketCodec::frame(WebSocketCodec::TEXT, message, &frame);
+		for (auto& x : sockets(cid)) send_frame(x, frame);
+	}
+
+	/* close_client: closes the sockets of a client whose session ended. */
+	void close_client(const ClientID& cid) {
+		unique_lock<mutex> ul(_mutex);
+		auto it = _clients.find(cid);
+		if (it == _clients.end()) return;
+		set<int> socks = it->second;
+		for (auto& x : socks) drop(x);
+	}
+
+protected:
+	struct Socket {
+		ClientID _cid;
+		int _sock;
+		struct MHD_UpgradeResponseHandle* _urh;
+		/* _read guards _in and _message */
+		mutex _read;
+		string _in;
+		string _message;
+		/* _write guards the socket, _closed, the outbound buffer and
+		 * whether EPOLLOUT is asked for */
+		mutex _write;
+		bool _closed;
+		string _out;
+		bool _writable_wait;
+		/* _queue guards the messages waiting for a handler thread and
+		 * whether the socket is queued for or held by one */
+		mutex _queue;
+		deque<string> _inbox;
+		bool _dispatched;
+	};
+
+	void loop() {
+		struct epoll_event events[64];
+		while (_alive) {
+			int n = epoll_wait(_epoll, events, 64, 250);
+			for (int i = 0; i < n; ++i) {
+				shared_ptr<Socket> s;
+				{
+					unique_lock<mutex> ul(_mutex);
+					auto it = _sockets.find(events[i].data.fd);
+					if (it == _sockets.end()) continue;
+					s = it->second;
+				}
+				bool ok = true;
+				if (events[i].events & EPOLLOUT) ok = flush(s.get());
+				if (ok && (events[i].events & ~EPOLLOUT)) {
+					unique_lock<mutex> read(s->_read);
+					ok = read_socket(s.get()) && receive(s);
+				}
+				if (!ok) {
+					unique_lock<mutex> ul(_mutex);
+					drop(s->_sock);
+				}
+			}
+		}
+	}
+
+	bool read_socket(Socket* s) {
+		char buf[16384];
+		while (true) {
+			ssize_t r = recv(s->_sock, buf, sizeof(buf), MSG_DONTWAIT);
+			if (r > 0) {
+				s->_in.append(buf, r);
+				continue;
+			}
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return true;
+			if (r < 0 && errno == EINTR) continue;
+			return false;
+		}
+	}
+
+	/* receive: handles the complete frames buffered for s, queueing its
+	 * messages for the handler threads. Returns false if the socket
+	 * should be closed. */
+	bool receive(shared_ptr<Socket> s) {
+		while (true) {
+			bool fin;
+			WebSocketCodec::Opcode opcode;
+			string payload;
+			ssize_t used = WebSocketCodec::parse(s->_in, &fin,
+							     &opcode, &payload);
+			if (used < 0) return false;
+			if (used == 0) return true;
+			s->_in.erase(0, used);
+
+			string frame;
+			switch (opcode) {
+			case WebSocketCodec::PING:
+				WebSocketCodec::frame(WebSocketCodec::PONG,
+						      payload, &frame);
+				send_frame(s, frame);
+				continue;
+			case WebSocketCodec::PONG:
+				continue;
+			case WebSocketCodec::CLOSE:
+				WebSocketCodec::frame(WebSocketCodec::CLOSE,
+						      "", &frame);
+				send_frame(s, frame);
+				return false;
+			default:
+				break;
+			}
+			s->_message += payload;
+			if (s->_message.length() > WEBSOCKET_MAX_MESSAGE)
+				return false;
+			if (!fin) continue;
+			if (!dispatch(s, move(s->_message))) {
+				Logger::error("(websocket) % has over % messages "
+					      "waiting", s->_cid,
+					      WEBSOCKET_MAX_PENDING);
+				return false;
+			}
+			s->_message.clear();
+		}
+	}
+
+	/* dispatch: queues a message of s, and s for a handler thread unless
+	 * one has it already. Returns false if too many are waiting. */
+	bool dispatch(shared_ptr<Socket> s, string&& message) {
+		{
+			unique_lock<mutex> ul(s->_queue);
+			if (s->_inbox.size() >= WEBSOCKET_MAX_PENDING)
+				return false;
+			s->_inbox.push_back(move(message));
+			if (s->_dispatched) return true;
+			s->_dispatched = true;
+		}
+		{
+			unique_lock<mutex> ul(_work_mutex);
+			_work.push_back(s);
+		}
+		_work_ready.notify_one();
+		return true;
+	}
+
+	/* handle: a handler thread, serving the queued messages of one
+	 * socket at a time. */
+	void handle() {
+		while (true) {
+			shared_ptr<Socket> s;
+			{
+				unique_lock<mutex> ul(_work_mutex);
+				_work_ready.wait(ul, [this]() {
+					return !_alive || !_work.empty();
+				});
+				if (!_alive) return;
+				s = _work.front();
+				_work.pop_front();
+			}
+			while (true) {
+				string message;
+				{
+					unique_lock<mutex> ul(s->_queue);
+					if (s->_inbox.empty()) {
+						s->_dispatched = false;
+						break;
+					}
+					message = move(s->_inbox.front());
+					s->_inbox.pop_front();
+				}
+				if (closed(s.get())) continue;
+				string frame;
+				WebSocketCodec::frame(WebSocketCodec::TEXT,
+						      _handler(s->_cid, message),
+						      &frame);
+				send_frame(s, frame);
+			}
+		}
+	}
+
+	bool closed(Socket* s) {
+		unique_lock<mutex> ul(s->_write);
+		return s->_closed;
+	}
+
+	/* send_frame: sends what the socket takes now and buffers the rest
+	 * for the epoll thread. */
+	void send_frame(shared_ptr<Socket> s, const string& frame) {
+		unique_lock<mutex> ul(s->_write);
+		if (s->_closed) return;
+		if (s->_out.length() + frame.length() > WEBSOCKET_MAX_OUTBOUND) {
+			Logger::error("(websocket) % is not reading; closing",
+				      s->_cid);
+			shutdown(s->_sock, SHUT_RDWR);
+			return;
+		}
+		s->_out += frame;
+		if (!write_out(s.get())) {
+			Logger::error("(websocket) send to % failed", s->_cid);
+			shutdown(s->_sock, SHUT_RDWR);
+		}
+	}
+
+	/* flush: sends the buffered frames of a writable socket. Returns
+	 * false if the socket should be closed. */
+	bool flush(Socket* s) {
+		unique_lock<mutex> ul(s->_write);
+		if (s->_closed) return true;
+		return write_out(s);
+	}
+
+	/* write_out: must hold s->_write. Sends as much of _out as the socket
+	 * takes without blocking, and asks epoll for EPOLLOUT while some is
+	 * left. Returns false on a send error. */
+	bool write_out(Socket* s) {
+		bool ok = send_out(s);
+		bool wait = ok && !s->_out.empty();
+		if (wait != s->_writable_wait) {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLRDHUP |
+				(wait ? (uint32_t) EPOLLOUT : 0u);
+			ev.data.fd = s->_sock;
+			epoll_ctl(_epoll, EPOLL_CTL_MOD, s->_sock, &ev);
+			s->_writable_wait = wait;
+		}
+		return ok;
+	}
+
+	/* send_out: must hold s->_write. Sends as much of _out as the socket
+	 * takes without blocking. Returns false on a send error. */
+	bool send_out(Socket* s) {
+		size_t done = 0;
+		bool ok = true;
+		while (done < s->_out.length()) {
+			ssize_t r = send(s->_sock, s->_out.data() + done,
+					 s->_out.length() - done,
+					 MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (r > 0) {
+				done += r;
+				continue;
+			}
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			ok = false;
+			break;
+		}
+		s->_out.erase(0, done);
+		return ok;
+	}
+
+	vector<shared_ptr<Socket>> sockets(const ClientID& cid) {
+		vector<shared_ptr<Socket>> retval;
+		unique_lock<mutex> ul(_mutex);
+		if (cid == CLIENT_ALL) {
+			for (auto& x : _sockets) retval.push_back(x.second);
+			return retval;
+		}
+		auto it = _clients.find(cid);
+		if (it == _clients.end()) return retval;
+		for (auto& x : it->second) retval.push_back(_sockets[x]);
+		return retval;
+	}
+
+	/* drop: must hold _mutex. What is still buffered, such as the CLOSE
+	 * frame answering the peer's, is sent if the socket takes it now;
+	 * then microhttpd closes the socket. */
+	void drop(int sock) {
+		auto it = _sockets.find(sock);
+		if (it == _sockets.end()) return;
+		shared_ptr<Socket> s = it->second;
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, sock, nullptr);
+		_sockets.erase(it);
+		auto client = _clients.find(s->_cid);
+		if (client != _clients.end()) {
+			client->second.erase(sock);
+			if (client->second.empty()) _clients.erase(client);
+		}
+		unique_lock<mutex> ul(s->_write);
+		if (!s->_closed) send_out(s.get());
+		s->_closed = true;
+		s->_out.clear();
+		MHD_upgrade_action(s->_urh, MHD_UPGRADE_ACTION_CLOSE);
+	}
+
+	Handler _handler;
+	int _epoll;
+	atomic<bool> _alive;
+	unique_ptr<thread> _thread;
+	mutex _mutex;
+	map<int, shared_ptr<Socket>> _sockets;
+	map<ClientID, set<int>> _clients;
+	/* sockets with messages for the handler threads */
+	mutex _work_mutex;
+	condition_variable _work_ready;
+	deque<shared_ptr<Socket>> _work;
+	vector<thread> _handlers;
+};
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__WEBSOCKET__H__
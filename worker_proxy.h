@@ -0,0 +1,868 @@
+#ifndef __CENTIPEDE__WORKER_PROXY__H__
+#define __CENTIPEDE__WORKER_PROXY__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <microhttpd.h>
+#include <mutex>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ib/logger.h"
+#include "centipede/access_log.h"
+#include "centipede/types.h"
+
+#define WORKER_BITS 8
+#define WORKER_SHIFT (64 - WORKER_BITS)
+#define WORKER_SOCKET_DIR "/tmp"
+#define WORKER_FORWARDED_HEADER "X-Centipede-Forwarded"
+#define WORKER_TIMEOUT_MS 30000
+#define WORKER_REPLY_BLOCK (64 << 10)
+#define WORKER_POLL_MS 1000
+
+using namespace ib;
+using namespace std;
+
+namespace centipede {
+
+class ProxyRequest;
+
+/* WorkerProxy lets several worker processes share one port, each owning
+ * the sessions it created. The owner of a session is kept in the top
+ * WORKER_BITS of its ClientID; the low bits stay random, so the session
+ * shards, which use the low bits, are unaffected. Each worker also serves
+ * on a unix socket, and a request that the kernel hands to a worker that
+ * does not own its session is passed to the owner over that socket and
+ * the reply relayed. The connections to other workers are non-blocking
+ * and one thread, started with start, waits on all of them with epoll
+ * and drives each ProxyRequest, so no server thread waits on a worker.
+ * Idle connections are kept for reuse. A single worker is the default
+ * and does none of this.
+ */
+class WorkerProxy {
+public:
+	WorkerProxy() : _index(0), _workers(1), _port(0), _epoll(-1),
+			_alive(false) {}
+
+	~WorkerProxy() {
+		stop();
+		for (auto& x : _idle) {
+			for (auto& fd : x) close(fd);
+		}
+	}
+
+	void configure(int index, int workers, int port) {
+		_index = index;
+		_workers = workers;
+		_port = port;
+		_idle.resize(workers);
+	}
+
+	bool enabled() const {
+		return _workers > 1;
+	}
+
+	int index() const {
+		return _index;
+	}
+
+	/* tag: marks a new random cid as owned by this worker. */
+	ClientID tag(const ClientID& cid) const {
+		if (!enabled()) return cid;
+		return (cid & ((1ULL << WORKER_SHIFT) - 1)) |
+			((ClientID) _index << WORKER_SHIFT);
+	}
+
+	int owner(const ClientID& cid) const {
+		return (cid >> WORKER_SHIFT) % _workers;
+	}
+
+	bool foreign(const ClientID& cid) const {
+		return enabled() && cid != CLIENT_ALL && owner(cid) != _index;
+	}
+
+	string socket_path(int worker) const {
+		return string(WORKER_SOCKET_DIR) + "/centipede." +
+			to_string(_port) + "." + to_string(worker) + ".sock";
+	}
+
+	/* listen_local: returns a listening unix socket for this worker, or
+	 * -1. A stale socket file from an earlier run is replaced. */
+	int listen_local() const {
+		string path = socket_path(_index);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		struct sockaddr_un addr;
+		if (!address(path, &addr)) {
+			close(fd);
+			return -1;
+		}
+		unlink(path.c_str());
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+		    listen(fd, SOMAXCONN)) {
+			Logger::error("(worker) cannot listen on %: %", path,
+				      strerror(errno));
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	/* fork_workers: forks workers - 1 children and returns the index of
+	 * the worker each process is, 0 in the parent. Call before
+	 * start_server. */
+	static int fork_workers(int workers) {
+		for (int i = 1; i < workers; ++i) {
+			pid_t pid = fork();
+			if (pid == 0) return i;
+			if (pid < 0) {
+				Logger::error("(worker) fork failed: %",
+					      strerror(errno));
+			}
+		}
+		return 0;
+	}
+
+	/* start: starts the thread that drives the exchanges with other
+	 * workers. */
+	void start() {
+		_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (_epoll < 0) {
+			Logger::error("(worker) epoll_create1 failed: %",
+				      strerror(errno));
+			return;
+		}
+		_alive = true;
+		_thread.reset(new thread(&WorkerProxy::loop, this));
+	}
+
+	void stop() {
+		if (!_alive) return;
+		_alive = false;
+		_thread->join();
+		unique_lock<mutex> ul(_watch_mutex);
+		_watched.clear();
+		close(_epoll);
+		_epoll = -1;
+	}
+
+	/* watch: has the thread drive request when fd, its connection to a
+	 * worker, has one of events. Until forget, the request is kept. */
+	void watch(int fd, const shared_ptr<ProxyRequest>& request,
+		   uint32_t events) {
+		unique_lock<mutex> ul(_watch_mutex);
+		_watched[fd] = request;
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	/* events: changes the events watched on fd. */
+	void events(int fd, uint32_t events) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	/* forget: stops watching fd, before it is closed or released. */
+	void forget(int fd) {
+		shared_ptr<ProxyRequest> request;
+		unique_lock<mutex> ul(_watch_mutex);
+		auto it = _watched.find(fd);
+		if (it == _watched.end()) return;
+		/* the caller holds a reference; the last one must not go
+		 * under the lock */
+		request = move(it->second);
+		_watched.erase(it);
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+	}
+
+	/* connect_to: a non-blocking connection to the worker, idle or new.
+	 * reused says which, since an idle one may have been closed at the
+	 * other end. */
+	int connect_to(int worker, bool* reused) {
+		{
+			unique_lock<mutex> ul(_mutex);
+			if (!_idle[worker].empty()) {
+				int fd = _idle[worker].back();
+				_idle[worker].pop_back();
+				*reused = true;
+				return fd;
+			}
+		}
+		*reused = false;
+		struct sockaddr_un addr;
+		if (!address(socket_path(worker), &addr)) return -1;
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC |
+				SOCK_NONBLOCK, 0);
+		if (fd < 0) return -1;
+		/* a unix socket connects at once, or fails with EAGAIN when
+		 * the worker's backlog is full */
+		if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+			Logger::error("(worker) cannot reach worker %: %",
+				      worker, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	/* release: keeps a connection whose reply was read in full. */
+	void release(int worker, int fd) {
+		unique_lock<mutex> ul(_mutex);
+		_idle[worker].push_back(fd);
+	}
+
+protected:
+	static bool address(const string& path, struct sockaddr_un* addr) {
+		memset(addr, 0, sizeof(*addr));
+		addr->sun_family = AF_UNIX;
+		if (path.length() >= sizeof(addr->sun_path)) return false;
+		memcpy(addr->sun_path, path.data(), path.length());
+		return true;
+	}
+
+	/* loop: the thread, defined after ProxyRequest. */
+	void loop();
+
+	int _index;
+	int _workers;
+	int _port;
+	mutex _mutex;
+	vector<vector<int>> _idle;
+	int _epoll;
+	atomic<bool> _alive;
+	unique_ptr<thread> _thread;
+	/* _watch_mutex guards _watched; a request's own lock, when held, is
+	 * taken first */
+	mutex _watch_mutex;
+	map<int, shared_ptr<ProxyRequest>> _watched;
+};
+
+/* ProxyRequest is one request being passed to the worker that owns its
+ * session, as an exchange on a non-blocking connection that the
+ * WorkerProxy's thread drives. The request line and headers, and the body
+ * in chunked encoding as it arrives, are buffered and sent as the worker
+ * takes them. The reply's status and headers are read and queued on the
+ * client's connection, and its body is relayed through a content reader
+ * as the client drains it, so a large reply is never held whole.
+ *
+ * Whenever the client's side has to wait on the worker, for it to take
+ * the buffered body, for the reply's head, or for more of its body, the
+ * client's connection is suspended and resumed from the proxy thread, so
+ * no server thread waits on a worker; in thread-per-connection mode, which
+ * cannot suspend, the connection's own thread waits instead. Waiting on
+ * the worker for WORKER_TIMEOUT_MS without progress fails the request.
+ * The connection to the worker is returned to the idle ones once the
+ * reply's body has been read to its end.
+ */
+class ProxyRequest : public enable_shared_from_this<ProxyRequest> {
+public:
+	ProxyRequest(WorkerProxy* proxy, int worker,
+		     struct MHD_Connection* connection, bool can_suspend)
+		: _proxy(proxy), _worker(worker), _connection(connection),
+		  _can_suspend(can_suspend), _suspended(false), _fd(-1),
+		  _events(0), _reused(false), _body(false), _finished(false),
+		  _head_done(false), _eof(false), _failed(false), _status(0),
+		  _framing(TO_CLOSE), _left(0), _keep_alive(true),
+		  _chunk_end(false), _trailer(false), _done(false),
+		  _starved(false), _stalled(0), _progress(0) {}
+
+	~ProxyRequest() {
+		if (_fd >= 0) close(_fd);
+	}
+
+	/* begin: connects and starts sending the request line and headers. */
+	bool begin(const string& method, const string& url,
+		   const string& client) {
+		_body = method != "GET" && method != "HEAD";
+		/* microhttpd has unescaped the path, as it has the query */
+		Query query = {method + " " + escape(url.c_str(), "/"), '?'};
+		MHD_get_connection_values(_connection, MHD_GET_ARGUMENT_KIND,
+					  &add_argument, &query);
+		_head = query.text;
+		_head += " HTTP/1.1\r\nHost: localhost\r\n";
+		_head += string(WORKER_FORWARDED_HEADER) + ": " + client +
+			"\r\n";
+		MHD_get_connection_values(_connection, MHD_HEADER_KIND,
+					  &add_header, &_head);
+		if (_body) _head += "Transfer-Encoding: chunked\r\n";
+		_head += "\r\n";
+		unique_lock<mutex> ul(_mutex);
+		return open();
+	}
+
+	/* body: passes on a piece of the request body. Returns false on an
+	 * error. While the worker has not taken what is buffered, *taken is
+	 * false and the connection is suspended; the piece is to be passed
+	 * again once it is resumed. */
+	bool body(const char* data, size_t size, bool* taken) {
+		unique_lock<mutex> ul(_mutex);
+		*taken = false;
+		if (!wait(ul, [this]() {
+			return _failed || _out.length() < WORKER_REPLY_BLOCK;
+		})) return true;
+		if (_failed) return false;
+		*taken = true;
+		if (!size || _fd < 0) return true;
+		char length[32];
+		snprintf(length, sizeof(length), "%zx\r\n", size);
+		_out += length;
+		_out.append(data, size);
+		_out += "\r\n";
+		send_some();
+		update();
+		return !_failed;
+	}
+
+	/* finish: ends the request. Once the reply's head has come, queues
+	 * the reply, its body to follow as the client reads it. Until then
+	 * the connection is suspended, and finish is called again when it is
+	 * resumed. */
+	int finish() {
+		unique_lock<mutex> ul(_mutex);
+		if (!_finished) {
+			_finished = true;
+			_progress = now_ms();
+			if (_body && _fd >= 0) {
+				_out += "0\r\n\r\n";
+				send_some();
+				update();
+			}
+		}
+		if (!wait(ul, [this]() { return _failed || _head_done; }))
+			return MHD_YES;
+		if (_failed) {
+			Logger::error("(worker) no reply from worker %",
+				      _worker);
+			return MHD_NO;
+		}
+		unsigned int status = _status;
+		bool empty = _done;
+		uint64_t length = _framing == LENGTH ? _left : MHD_SIZE_UNKNOWN;
+		ul.unlock();
+
+		struct MHD_Response* response;
+		if (empty) {
+			response = MHD_create_response_from_buffer(
+				0, (void *) "", MHD_RESPMEM_PERSISTENT);
+		} else {
+			shared_ptr<ProxyRequest>* reader =
+				new shared_ptr<ProxyRequest>(shared_from_this());
+			response = MHD_create_response_from_callback(
+				length, WORKER_REPLY_BLOCK, &read, reader, &free);
+			if (!response) {
+				delete reader;
+				return MHD_NO;
+			}
+		}
+		for (auto& x : _headers) {
+			MHD_add_response_header(response, x.first.c_str(),
+						x.second.c_str());
+		}
+		AccessLog::reply(status);
+		int ret = MHD_queue_response(_connection, status, response);
+		MHD_destroy_response(response);
+		return ret;
+	}
+
+	/* abandon: the client's connection is done with the request, which
+	 * gives up its connection to the worker unless that was already
+	 * returned. */
+	void abandon() {
+		unique_lock<mutex> ul(_mutex);
+		_connection = nullptr;
+		if (!_done) _failed = true;
+		drop();
+	}
+
+	/* on_event: the proxy thread's turn, when the worker's connection
+	 * is ready. */
+	void on_event(uint32_t events) {
+		unique_lock<mutex> ul(_mutex);
+		if (_fd < 0) return;
+		if (events & EPOLLOUT) send_some();
+		if (_fd >= 0 && (events & ~EPOLLOUT)) receive_some();
+		if (_fd >= 0) update();
+	}
+
+	/* expire: fails the request if it has waited on the worker for
+	 * WORKER_TIMEOUT_MS without progress. */
+	void expire(uint64_t now) {
+		unique_lock<mutex> ul(_mutex);
+		if (_fd < 0 || !waiting() || now - _progress < WORKER_TIMEOUT_MS)
+			return;
+		Logger::error("(worker) worker % timed out", _worker);
+		fail();
+	}
+
+protected:
+	enum Framing {
+		LENGTH,		/* Content-Length bytes */
+		CHUNKED,	/* Transfer-Encoding: chunked */
+		TO_CLOSE,	/* until the worker closes the connection */
+	};
+
+	/* read: the content reader callback. */
+	static ssize_t read(void* cls, uint64_t position, char* buf,
+			    size_t max) {
+		return (*(shared_ptr<ProxyRequest>*) cls)->relay(buf, max);
+	}
+
+	static void free(void* cls) {
+		shared_ptr<ProxyRequest>* reader = (shared_ptr<ProxyRequest>*) cls;
+		(*reader)->abandon();
+		delete reader;
+	}
+
+	static uint64_t now_ms() {
+		return chrono::duration_cast<chrono::milliseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/* relay: copies up to max more bytes of the body into buf, as the
+	 * content reader returns them. */
+	ssize_t relay(char* buf, size_t max) {
+		unique_lock<mutex> ul(_mutex);
+		while (true) {
+			ssize_t r = _failed ? -1 : next(buf, max);
+			if (r > 0) {
+				_starved = false;
+				if (_fd >= 0) update();
+				return r;
+			}
+			if (r < 0 || (!_done && _eof)) {
+				Logger::error("(worker) reply from worker % cut "
+					      "short", _worker);
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
+			if (_done) return MHD_CONTENT_READER_END_OF_STREAM;
+			if (!_starved) _progress = now_ms();
+			_starved = true;
+			_stalled = _in.length();
+			if (!wait(ul, [this]() {
+				return _failed || _eof ||
+					_in.length() != _stalled;
+			})) return 0;
+		}
+	}
+
+	/* wait: returns true if ready(). Otherwise suspends the connection
+	 * and returns false, or without suspend and resume waits for it.
+	 * Must hold _mutex. */
+	template<typename F>
+	bool wait(unique_lock<mutex>& ul, F ready) {
+		if (ready()) return true;
+		if (!_can_suspend) {
+			_cv.wait(ul, ready);
+			return true;
+		}
+		if (_connection) {
+			MHD_suspend_connection(_connection);
+			_suspended = true;
+		}
+		return false;
+	}
+
+	/* wake: resumes a connection waiting on the worker. Must hold
+	 * _mutex. */
+	void wake() {
+		if (_suspended && _connection) {
+			_suspended = false;
+			MHD_resume_connection(_connection);
+		}
+		_cv.notify_all();
+	}
+
+	/* open: connects to the worker and starts sending the head. Must
+	 * hold _mutex. */
+	bool open() {
+		_fd = _proxy->connect_to(_worker, &_reused);
+		if (_fd < 0) return false;
+		_out = _head;
+		_progress = now_ms();
+		_events = EPOLLIN | EPOLLRDHUP;
+		_proxy->watch(_fd, shared_from_this(), _events);
+		send_some();
+		if (_fd >= 0) update();
+		return !_failed;
+	}
+
+	/* retry: whether a failure before any reply came may be an idle
+	 * connection the worker had closed, in which case the request is
+	 * sent again once on a new one. Must hold _mutex. */
+	bool retry() {
+		if (!_reused || _body || _head_done || !_in.empty())
+			return false;
+		drop();
+		_eof = false;
+		return open();
+	}
+
+	/* fail: must hold _mutex. */
+	void fail() {
+		_failed = true;
+		drop();
+		wake();
+	}
+
+	/* drop: closes the connection to the worker, if still held. Must
+	 * hold _mutex. */
+	void drop() {
+		_out.clear();
+		if (_fd < 0) return;
+		_proxy->forget(_fd);
+		close(_fd);
+		_fd = -1;
+	}
+
+	/* waiting: whether the request is waiting on the worker rather than
+	 * on the client. Must hold _mutex. */
+	bool waiting() const {
+		return !_out.empty() || (_finished && !_head_done) || _starved;
+	}
+
+	/* update: asks for the events the exchange waits on: writable while
+	 * some of the request is buffered, readable until the reply is in
+	 * and while the buffered body is short. Must hold _mutex. */
+	void update() {
+		if (_fd < 0) return;
+		uint32_t events = EPOLLRDHUP;
+		if (!_out.empty()) events |= EPOLLOUT;
+		if (!_eof && (!_head_done || _in.length() < 2 * WORKER_REPLY_BLOCK))
+			events |= EPOLLIN;
+		if (events == _events) return;
+		_events = events;
+		_proxy->events(_fd, events);
+	}
+
+	/* send_some: sends as much of _out as the worker takes now. Must
+	 * hold _mutex. */
+	void send_some() {
+		if (_fd < 0) {
+			_out.clear();
+			return;
+		}
+		size_t done = 0;
+		while (done < _out.length()) {
+			ssize_t r = send(_fd, _out.data() + done,
+					 _out.length() - done,
+					 MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (r > 0) {
+				done += r;
+				continue;
+			}
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			_out.erase(0, done);
+			if (!retry()) fail();
+			return;
+		}
+		if (!done) return;
+		_out.erase(0, done);
+		_progress = now_ms();
+		if (_out.length() < WORKER_REPLY_BLOCK) wake();
+	}
+
+	/* receive_some: reads what the worker has sent, up to a bound on
+	 * what is buffered, and parses the reply's head once it is in.
+	 * Must hold _mutex. */
+	void receive_some() {
+		char buf[16384];
+		bool received = false;
+		while (!_eof && _in.length() < 2 * WORKER_REPLY_BLOCK) {
+			ssize_t r = recv(_fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (r > 0) {
+				_in.append(buf, r);
+				received = true;
+				continue;
+			}
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			_eof = true;
+		}
+		if (received) _progress = now_ms();
+		if (!_head_done) {
+			size_t end = _in.find("\r\n\r\n");
+			if (end == string::npos) {
+				if (_eof || _in.length() >= 2 * WORKER_REPLY_BLOCK) {
+					if (!retry()) fail();
+				}
+				return;
+			}
+			if (!read_head(end)) {
+				Logger::error("(worker) bad reply from worker %",
+					      _worker);
+				fail();
+				return;
+			}
+			_head_done = true;
+			if (_framing == LENGTH && !_left) finished();
+		}
+		/* nothing more can come; the rest of the reply, if any, is
+		 * in _in */
+		if (_eof) drop();
+		if (received || _eof) wake();
+	}
+
+	/* read_head: parses the status line and headers that end at end,
+	 * leaving in _in whatever of the body came with them. Must hold
+	 * _mutex. */
+	bool read_head(size_t end) {
+		size_t line = _in.find("\r\n");
+		size_t space = _in.find(' ');
+		if (space > line) return false;
+		_status = atoi(_in.c_str() + space + 1);
+		bool length = false;
+		for (size_t pos = line + 2; pos < end; ) {
+			size_t next = _in.find("\r\n", pos);
+			size_t colon = _in.find(':', pos);
+			if (colon < next) {
+				string key = _in.substr(pos, colon - pos);
+				size_t v = _in.find_first_not_of(' ', colon + 1);
+				string value = _in.substr(v, next - v);
+				if (!strcasecmp(key.c_str(), "Content-Length")) {
+					_left = strtoull(value.c_str(), nullptr,
+							 10);
+					length = true;
+				} else if (!strcasecmp(key.c_str(),
+						       "Transfer-Encoding")) {
+					_framing = CHUNKED;
+				} else if (!strcasecmp(key.c_str(),
+						       "Connection")) {
+					_keep_alive = strcasecmp(
+						value.c_str(), "close");
+				} else if (strcasecmp(key.c_str(), "Date") &&
+					   strcasecmp(key.c_str(),
+						      "Keep-Alive")) {
+					_headers.emplace_back(key, value);
+				}
+			}
+			pos = next + 2;
+		}
+		_in.erase(0, end + 4);
+		if (_status < 200 || _status == 204 || _status == 304) {
+			/* no body, whatever the headers say */
+			_framing = LENGTH;
+			_left = 0;
+		} else if (_framing != CHUNKED && length) {
+			_framing = LENGTH;
+		}
+		if (_framing == TO_CLOSE) _keep_alive = false;
+		if (_framing == CHUNKED) _left = 0;
+		return true;
+	}
+
+	/* next: takes up to max more bytes of the body from _in into buf.
+	 * Returns 0 if none are buffered yet or at the end, which sets
+	 * _done, or -1 on an error. Must hold _mutex. */
+	ssize_t next(char* buf, size_t max) {
+		if (_done) return 0;
+		if (_framing == CHUNKED && !_left) {
+			if (!next_chunk()) return 0;
+			if (_done) return 0;
+		}
+		if (_framing == TO_CLOSE && _in.empty() && _eof) {
+			finished();
+			return 0;
+		}
+		if (_framing != TO_CLOSE) max = min<uint64_t>(max, _left);
+		size_t n = min(max, _in.length());
+		if (!n) return 0;
+		memcpy(buf, _in.data(), n);
+		_in.erase(0, n);
+		consumed(n);
+		return n;
+	}
+
+	/* next_chunk: takes the size line of the next chunk from _in, after
+	 * the CRLF ending the previous one, or the trailer after the last.
+	 * Returns false if they are not all buffered yet. */
+	bool next_chunk() {
+		if (_chunk_end) {
+			if (_in.length() < 2) return false;
+			_in.erase(0, 2);
+			_chunk_end = false;
+		}
+		if (!_trailer) {
+			size_t end = _in.find("\r\n");
+			if (end == string::npos) return false;
+			_left = strtoull(_in.c_str(), nullptr, 16);
+			_in.erase(0, end + 2);
+			if (_left) return true;
+			_trailer = true;
+		}
+		while (true) {
+			size_t end = _in.find("\r\n");
+			if (end == string::npos) return false;
+			_in.erase(0, end + 2);
+			if (!end) break;
+		}
+		finished();
+		return true;
+	}
+
+	void consumed(size_t n) {
+		if (_framing == TO_CLOSE) return;
+		_left -= n;
+		if (_left) return;
+		if (_framing == CHUNKED) {
+			_chunk_end = true;
+			return;
+		}
+		finished();
+	}
+
+	/* finished: the body has been read in full, so the connection can
+	 * take the next request. Must hold _mutex. */
+	void finished() {
+		_done = true;
+		if (_fd < 0) return;
+		if (!_keep_alive || !_in.empty() || !_out.empty()) {
+			drop();
+			return;
+		}
+		_proxy->forget(_fd);
+		_proxy->release(_worker, _fd);
+		_fd = -1;
+	}
+
+	/* Query is the url being rebuilt from the decoded GET arguments. */
+	struct Query {
+		string text;
+		char separator;
+	};
+
+	/* escape: percent-encodes all of value but the unreserved
+	 * characters and those in kept. */
+	static string escape(const char* value, const char* kept = "") {
+		static const char hex[] = "0123456789ABCDEF";
+		string retval;
+		for (const char* c = value; *c; ++c) {
+			if (isalnum((unsigned char) *c) || strchr("-_.~", *c) ||
+			    strchr(kept, *c)) {
+				retval.push_back(*c);
+			} else {
+				retval.push_back('%');
+				retval.push_back(hex[(unsigned char) *c >> 4]);
+				retval.push_back(hex[*c & 15]);
+			}
+		}
+		return retval;
+	}
+
+	static int add_argument(void* cls, enum MHD_ValueKind kind,
+				const char* key, const char* value) {
+		Query* query = static_cast<Query*>(cls);
+		query->text.push_back(query->separator);
+		query->separator = '&';
+		query->text += escape(key);
+		if (value) query->text += "=" + escape(value);
+		return MHD_YES;
+	}
+
+	static int add_header(void* cls, enum MHD_ValueKind kind,
+			      const char* key, const char* value) {
+		static const char* skipped[] = {
+			"Host", "Connection", "Keep-Alive", "Content-Length",
+			"Transfer-Encoding", "Upgrade", "Expect",
+			WORKER_FORWARDED_HEADER,
+		};
+		for (auto x : skipped) {
+			if (!strcasecmp(key, x)) return MHD_YES;
+		}
+		string* head = static_cast<string*>(cls);
+		*head += string(key) + ": " + (value ? value : "") + "\r\n";
+		return MHD_YES;
+	}
+
+	WorkerProxy* _proxy;
+	int _worker;
+	/* _mutex guards everything below; the proxy thread and the client's
+	 * connection both drive the exchange */
+	mutex _mutex;
+	condition_variable _cv;
+	struct MHD_Connection* _connection;
+	bool _can_suspend;
+	bool _suspended;
+	int _fd;
+	uint32_t _events;
+	bool _reused;
+	bool _body;
+	bool _finished;
+	string _head;
+	/* sent as the worker takes it */
+	string _out;
+	/* received and not yet relayed */
+	string _in;
+	bool _head_done;
+	bool _eof;
+	bool _failed;
+	unsigned int _status;
+	vector<pair<string, string>> _headers;
+	Framing _framing;
+	/* left of the body, or of the current chunk */
+	uint64_t _left;
+	bool _keep_alive;
+	/* the CRLF after a chunk's data is still to be read */
+	bool _chunk_end;
+	/* the last chunk is in and its trailer is being read */
+	bool _trailer;
+	bool _done;
+	/* the content reader waits for more of the body, beyond _stalled
+	 * bytes */
+	bool _starved;
+	size_t _stalled;
+	/* when the worker last took or sent something, in ms */
+	uint64_t _progress;
+};
+
+inline void WorkerProxy::loop() {
+	struct epoll_event events[64];
+	uint64_t swept = 0;
+	while (_alive) {
+		int n = epoll_wait(_epoll, events, 64, WORKER_POLL_MS);
+		for (int i = 0; i < n; ++i) {
+			shared_ptr<ProxyRequest> request;
+			{
+				unique_lock<mutex> ul(_watch_mutex);
+				auto it = _watched.find(events[i].data.fd);
+				if (it == _watched.end()) continue;
+				request = it->second;
+			}
+			request->on_event(events[i].events);
+		}
+		uint64_t now = chrono::duration_cast<chrono::milliseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+		if (now - swept < WORKER_POLL_MS) continue;
+		swept = now;
+		vector<shared_ptr<ProxyRequest>> requests;
+		{
+			unique_lock<mutex> ul(_watch_mutex);
+			for (auto& x : _watched) requests.push_back(x.second);
+		}
+		for (auto& x : requests) x->expire(now);
+	}
+}
+
+}  // namespace centipede
+
+#endif  // __CENTIPEDE__WORKER_PROXY__H__